@@ -0,0 +1,234 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "blockmetadata.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+
+#include <climits>
+
+void BlockMetadata::reset(int blockCount)
+{
+    m_blocks.clear();
+    m_blocks.resize(blockCount);
+    invalidateFolds();
+}
+
+void BlockMetadata::resize(int blockCount)
+{
+    const int oldSize = m_blocks.size();
+    m_blocks.resize(blockCount);
+    if (blockCount > oldSize)
+        markRegionsDirty(oldSize, blockCount - 1);
+    m_foldTreeDirty = true;
+}
+
+void BlockMetadata::documentChanged(const QTextDocument *document, int position)
+{
+    const int blockCount = document->blockCount();
+    const int delta = blockCount - m_blocks.size();
+    if (delta != 0) {
+        // The block containing the start of the edit existed before the
+        // change, so any added or removed blocks immediately follow it.
+        const int first = qBound(0, document->findBlock(position).blockNumber() + 1,
+                                 m_blocks.size());
+        if (delta > 0)
+            m_blocks.insert(first, delta, BlockData());
+        else
+            m_blocks.remove(first, qMin(-delta, m_blocks.size() - first));
+        if (m_blocks.size() != blockCount)
+            m_blocks.resize(blockCount);
+
+        // The inserted blocks and the block following them (which now has
+        // a different predecessor) need to be scanned.  Any blocks already
+        // waiting for a scan have moved.
+        if (m_regionsDirtyFrom <= m_regionsDirtyTo && m_regionsDirtyTo >= first)
+            m_regionsDirtyTo = qMax(first, m_regionsDirtyTo + delta);
+        markRegionsDirty(first, first + qMax(delta, 0));
+        m_foldTreeDirty = true;
+    }
+}
+
+bool BlockMetadata::setFoldMarkers(int blockNumber, const QVector<FoldMarker> &markers)
+{
+    if (blockNumber < 0 || blockNumber >= m_blocks.size())
+        return false;
+
+    BlockData &data = m_blocks[blockNumber];
+    if (data.foldMarkers == markers)
+        return false;
+    data.foldMarkers = markers;
+    markRegionsDirty(blockNumber, blockNumber);
+    return true;
+}
+
+void BlockMetadata::setIndentation(int blockNumber, int indent, int indentPos, bool empty)
+{
+    if (blockNumber < 0 || blockNumber >= m_blocks.size())
+        return;
+
+    BlockData &data = m_blocks[blockNumber];
+    if (!data.indentValid || data.indent != indent || data.empty != empty)
+        m_foldTreeDirty = true;
+    data.indent = indent;
+    data.indentPos = indentPos;
+    data.empty = empty;
+    data.indentValid = true;
+}
+
+void BlockMetadata::invalidateIndentation()
+{
+    for (auto &data : m_blocks)
+        data.indentValid = false;
+    m_foldTreeDirty = true;
+}
+
+void BlockMetadata::invalidateIndentation(int blockNumber)
+{
+    if (blockNumber >= 0 && blockNumber < m_blocks.size())
+        m_blocks[blockNumber].indentValid = false;
+}
+
+void BlockMetadata::invalidateFolds()
+{
+    m_regionsDirtyFrom = 0;
+    m_regionsDirtyTo = m_blocks.size() - 1;
+    m_foldTreeDirty = true;
+}
+
+void BlockMetadata::markRegionsDirty(int first, int last)
+{
+    if (m_regionsDirtyFrom > m_regionsDirtyTo) {
+        m_regionsDirtyFrom = first;
+        m_regionsDirtyTo = last;
+    } else {
+        m_regionsDirtyFrom = qMin(m_regionsDirtyFrom, first);
+        m_regionsDirtyTo = qMax(m_regionsDirtyTo, last);
+    }
+}
+
+static RegionState closeRegion(const RegionState &state, quint16 regionId)
+{
+    // Regions closed out of order are removed from the middle of the
+    // stack, and the regions above them are copied with the same serials.
+    QVector<const RegionNode *> above;
+    const RegionNode *node = state.get();
+    while (node && node->regionId != regionId) {
+        above.append(node);
+        node = node->parent.get();
+    }
+    if (!node)
+        return state;
+
+    RegionState closed = node->parent;
+    for (int i = above.size() - 1; i >= 0; --i)
+        closed = std::make_shared<RegionNode>(RegionNode{closed, above.at(i)->serial, above.at(i)->regionId});
+    return closed;
+}
+
+static bool sameRegions(const RegionNode *left, const RegionNode *right)
+{
+    while (left != right) {
+        if (!left || !right || left->serial != right->serial)
+            return false;
+        left = left->parent.get();
+        right = right->parent.get();
+    }
+    return true;
+}
+
+static bool regionOpen(const RegionNode *state, quint64 serial)
+{
+    // Serials decrease toward the bottom of the stack
+    while (state && state->serial > serial)
+        state = state->parent.get();
+    return state && state->serial == serial;
+}
+
+void BlockMetadata::updateRegions()
+{
+    const int lastDirty = qMin(m_regionsDirtyTo, m_blocks.size() - 1);
+    if (m_regionsDirtyFrom > lastDirty) {
+        m_regionsDirtyFrom = INT_MAX;
+        m_regionsDirtyTo = -1;
+        return;
+    }
+
+    RegionState state;
+    if (m_regionsDirtyFrom > 0)
+        state = m_blocks.at(m_regionsDirtyFrom - 1).regionState;
+    for (int i = m_regionsDirtyFrom; i < m_blocks.size(); ++i) {
+        BlockData &data = m_blocks[i];
+        data.foldSerial = 0;
+        for (const FoldMarker &marker : std::as_const(data.foldMarkers)) {
+            if (marker.begin) {
+                state = std::make_shared<RegionNode>(RegionNode{state, ++m_regionSerial, marker.regionId});
+                data.foldSerial = m_regionSerial;
+            } else {
+                state = closeRegion(state, marker.regionId);
+            }
+        }
+
+        // Past the changed blocks, the rest of the document was scanned
+        // from the same state and doesn't need to be scanned again.
+        const bool converged = (i >= lastDirty)
+                && sameRegions(state.get(), data.regionState.get());
+        data.regionState = state;
+        if (converged)
+            break;
+    }
+
+    m_regionsDirtyFrom = INT_MAX;
+    m_regionsDirtyTo = -1;
+    m_foldTreeDirty = true;
+}
+
+int BlockMetadata::regionFoldEnd(int blockNumber) const
+{
+    if (blockNumber < 0 || blockNumber >= m_blocks.size())
+        return NoFold;
+    const quint64 serial = m_blocks.at(blockNumber).foldSerial;
+    if (serial == 0)
+        return NoFold;
+
+    // A region stays open in a contiguous range of blocks once opened, so
+    // the block that closes it is the first one where it's no longer open.
+    int low = blockNumber + 1;
+    int high = m_blocks.size();
+    while (low < high) {
+        const int mid = low + (high - low) / 2;
+        if (regionOpen(m_blocks.at(mid).regionState.get(), serial))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return (low == m_blocks.size()) ? UnterminatedFold : low;
+}
+
+int BlockMetadata::foldParent(int blockNumber) const
+{
+    if (blockNumber < 0 || blockNumber >= m_blocks.size())
+        return -1;
+    return m_blocks.at(blockNumber).foldParent;
+}
+
+int BlockMetadata::foldDepth(int blockNumber) const
+{
+    if (blockNumber < 0 || blockNumber >= m_blocks.size())
+        return 0;
+    return m_blocks.at(blockNumber).foldDepth;
+}
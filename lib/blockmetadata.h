@@ -0,0 +1,140 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_BLOCKMETADATA_H
+#define QTEXTPAD_BLOCKMETADATA_H
+
+#include <QVector>
+
+#include <memory>
+
+class QTextDocument;
+
+struct FoldMarker
+{
+    quint16 regionId;
+    bool begin;
+
+    bool operator==(const FoldMarker &other) const
+    {
+        return regionId == other.regionId && begin == other.begin;
+    }
+    bool operator!=(const FoldMarker &other) const { return !operator==(other); }
+};
+
+// The folding regions left open at the end of a block, innermost first.
+// Blocks share the unchanged part of the stack with the blocks before them.
+// Each region keeps the serial number it was opened with, even if it has
+// to be copied when a region below it is closed out of order.
+struct RegionNode
+{
+    std::shared_ptr<const RegionNode> parent;
+    quint64 serial;
+    quint16 regionId;
+};
+typedef std::shared_ptr<const RegionNode> RegionState;
+
+// Per-block data kept alongside the document, indexed by block number.
+// KSyntaxHighlighting owns the QTextBlockUserData for each block, so this
+// is stored separately and kept in sync with the document's block list.
+class BlockMetadata
+{
+public:
+    enum
+    {
+        NoFold = -1,
+        UnterminatedFold = 0x7fffffff,
+    };
+
+    struct BlockData
+    {
+        // Folding region markers left open or closed by this block
+        QVector<FoldMarker> foldMarkers;
+
+        // Open regions at the end of this block, and the serial number of
+        // the region folded by this block (the last one it opens), or 0
+        RegionState regionState;
+        quint64 foldSerial;
+
+        // The innermost fold enclosing this block (not including a fold
+        // started by this block), and the fold nesting depth.  For blocks
+        // that start a fold, the depth is that fold's level, starting at 1.
+        int foldParent;
+        int foldDepth;
+
+        // Cached leading indentation (in columns) and the position of the
+        // first non-indentation character, and whether the block is
+        // considered empty for the purposes of indentation-based folding
+        int indent;
+        int indentPos;
+        bool empty;
+        bool indentValid;
+
+        BlockData()
+            : foldSerial(), foldParent(-1), foldDepth(0), indent(0),
+              indentPos(0), empty(true), indentValid(false) { }
+    };
+
+    BlockMetadata()
+        : m_regionSerial(), m_regionsDirtyFrom(0), m_regionsDirtyTo(0),
+          m_foldTreeDirty(true) { }
+
+    void reset(int blockCount);
+    void resize(int blockCount);
+    int size() const { return m_blocks.size(); }
+
+    // Insert or remove entries to match the document after an edit
+    // starting at the specified position.
+    void documentChanged(const QTextDocument *document, int position);
+
+    BlockData &operator[](int blockNumber) { return m_blocks[blockNumber]; }
+    const BlockData &at(int blockNumber) const { return m_blocks.at(blockNumber); }
+
+    bool setFoldMarkers(int blockNumber, const QVector<FoldMarker> &markers);
+    void setIndentation(int blockNumber, int indent, int indentPos, bool empty);
+    void invalidateIndentation();
+    void invalidateIndentation(int blockNumber);
+    int foldParent(int blockNumber) const;
+    int foldDepth(int blockNumber) const;
+
+    // Re-scan the open regions from the first changed block, until the
+    // region state matches what it was before the change.
+    void updateRegions();
+
+    // End of the region fold starting at the block, found with a binary
+    // search over the region states.  The regions must be up to date.
+    int regionFoldEnd(int blockNumber) const;
+
+    void invalidateFolds();
+    void invalidateFoldTree() { m_foldTreeDirty = true; }
+    void setFoldTreeValid() { m_foldTreeDirty = false; }
+    bool foldTreeDirty() const { return m_foldTreeDirty; }
+
+private:
+    QVector<BlockData> m_blocks;
+    quint64 m_regionSerial;
+
+    // Range of blocks that must be re-scanned before the region state can
+    // be compared with the previous scan.  Clean when m_regionsDirtyFrom
+    // is past the end of the document.
+    int m_regionsDirtyFrom;
+    int m_regionsDirtyTo;
+    bool m_foldTreeDirty;
+
+    void markRegionsDirty(int first, int last);
+};
+
+#endif  // QTEXTPAD_BLOCKMETADATA_H
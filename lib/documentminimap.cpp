@@ -0,0 +1,339 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "documentminimap.h"
+#include "syntaxtextedit.h"
+
+#include <QTextBlock>
+#include <QTextLayout>
+#include <QScrollBar>
+#include <QPainter>
+#include <QPaintEvent>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <QTimer>
+#include <QThreadPool>
+#include <QPointer>
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <climits>
+
+#define MINIMAP_WIDTH           100
+#define MINIMAP_LINE_HEIGHT     2
+
+// Delay before re-rendering, so a burst of edits is rendered only once
+#define MINIMAP_RENDER_DELAY    30
+
+struct MinimapRun
+{
+    int start;
+    int length;
+    QRgb color;
+};
+
+struct MinimapLine
+{
+    QString text;
+    QVector<MinimapRun> runs;
+};
+
+DocumentMinimap::DocumentMinimap(SyntaxTextEdit *editor)
+    : QWidget(editor), m_editor(editor), m_firstLine(), m_blockCount(),
+      m_dirtyFirst(-1), m_dirtyLast(-1), m_generation(), m_renderPending()
+{
+    setCursor(Qt::ArrowCursor);
+    setAttribute(Qt::WA_OpaquePaintEvent);
+
+    m_renderTimer = new QTimer(this);
+    m_renderTimer->setSingleShot(true);
+    m_renderTimer->setInterval(MINIMAP_RENDER_DELAY);
+    connect(m_renderTimer, &QTimer::timeout, this, &DocumentMinimap::startRender);
+
+    m_blockCount = editor->document()->blockCount();
+    connect(editor->document(), &QTextDocument::contentsChange,
+            this, &DocumentMinimap::documentChanged);
+    connect(editor->verticalScrollBar(), &QScrollBar::valueChanged,
+            this, &DocumentMinimap::editorScrolled);
+    connect(editor->verticalScrollBar(), &QScrollBar::rangeChanged,
+            this, &DocumentMinimap::editorScrolled);
+}
+
+void DocumentMinimap::setColors(const QColor &text, const QColor &background,
+                                const QColor &viewport)
+{
+    m_textColor = text;
+    m_backgroundColor = background;
+    m_viewportColor = viewport;
+    invalidateAll();
+}
+
+QSize DocumentMinimap::sizeHint() const
+{
+    return QSize(MINIMAP_WIDTH, 0);
+}
+
+int DocumentMinimap::visibleLines() const
+{
+    return qMax(1, height() / MINIMAP_LINE_HEIGHT);
+}
+
+int DocumentMinimap::firstLineForEditor() const
+{
+    // When the document doesn't fit, the minimap scrolls proportionally
+    // with the editor.
+    const int hiddenLines = m_editor->document()->blockCount() - visibleLines();
+    const QScrollBar *scrollBar = m_editor->verticalScrollBar();
+    if (hiddenLines <= 0 || scrollBar->maximum() <= 0)
+        return 0;
+    return qRound(qreal(scrollBar->value()) / scrollBar->maximum() * hiddenLines);
+}
+
+void DocumentMinimap::documentChanged(int position, int, int charsAdded)
+{
+    // Only text changes are reported here.  Highlighting changes, which
+    // can reach past the edited blocks, arrive via blocksHighlighted().
+    const QTextDocument *doc = m_editor->document();
+    const int first = doc->findBlock(position).blockNumber();
+    if (doc->blockCount() != m_blockCount) {
+        // Everything after the change has moved
+        m_blockCount = doc->blockCount();
+        invalidate(first, INT_MAX);
+    } else {
+        invalidate(first, doc->findBlock(position + charsAdded).blockNumber());
+    }
+}
+
+void DocumentMinimap::blocksHighlighted(int firstBlock, int lastBlock)
+{
+    invalidate(firstBlock, lastBlock);
+}
+
+void DocumentMinimap::editorScrolled()
+{
+    const int firstLine = firstLineForEditor();
+    const int delta = firstLine - m_firstLine;
+    if (delta != 0) {
+        m_generation += 1;
+        const int lines = visibleLines();
+        if (qAbs(delta) >= lines) {
+            m_firstLine = firstLine;
+            invalidateAll();
+            return;
+        }
+
+        // Keep the rows that are still visible, and render the new ones
+        QImage shifted(m_image.size(), m_image.format());
+        shifted.fill(m_backgroundColor);
+        QPainter painter(&shifted);
+        painter.drawImage(0, -delta * MINIMAP_LINE_HEIGHT, m_image);
+        painter.end();
+        m_image = shifted;
+        m_firstLine = firstLine;
+
+        if (delta > 0)
+            invalidate(firstLine + lines - delta, firstLine + lines - 1);
+        else
+            invalidate(firstLine, firstLine - delta - 1);
+    }
+
+    // The viewport rectangle moves even if the minimap doesn't
+    update();
+}
+
+void DocumentMinimap::invalidate(int first, int last)
+{
+    first = qMax(first, m_firstLine);
+    last = qMin(last, m_firstLine + visibleLines() - 1);
+    if (first > last)
+        return;
+
+    if (m_dirtyFirst < 0) {
+        m_dirtyFirst = first;
+        m_dirtyLast = last;
+    } else {
+        m_dirtyFirst = qMin(m_dirtyFirst, first);
+        m_dirtyLast = qMax(m_dirtyLast, last);
+    }
+    if (!m_renderPending && !m_renderTimer->isActive())
+        m_renderTimer->start();
+}
+
+void DocumentMinimap::invalidateAll()
+{
+    m_generation += 1;
+    m_dirtyFirst = -1;
+    m_dirtyLast = -1;
+    invalidate(m_firstLine, INT_MAX);
+}
+
+static QImage renderMinimapLines(const QVector<MinimapLine> &lines, int tabWidth,
+                                 QRgb textColor, QRgb background)
+{
+    QImage image(MINIMAP_WIDTH, lines.size() * MINIMAP_LINE_HEIGHT, QImage::Format_RGB32);
+    image.fill(background);
+
+    // Text is drawn at 2/3 intensity over the background
+    auto blend = [background](QRgb color) {
+        return qRgb((qRed(color) * 2 + qRed(background)) / 3,
+                    (qGreen(color) * 2 + qGreen(background)) / 3,
+                    (qBlue(color) * 2 + qBlue(background)) / 3);
+    };
+
+    for (int i = 0; i < lines.size(); ++i) {
+        const MinimapLine &line = lines.at(i);
+        // Only the first row is drawn, leaving a gap between lines
+        auto row = reinterpret_cast<QRgb *>(image.scanLine(i * MINIMAP_LINE_HEIGHT));
+        int column = 0;
+        int run = 0;
+        for (int pos = 0; pos < line.text.size() && column < MINIMAP_WIDTH; ++pos) {
+            const QChar ch = line.text.at(pos);
+            if (ch == QLatin1Char('\t')) {
+                column += tabWidth - (column % tabWidth);
+                continue;
+            }
+            if (!ch.isSpace()) {
+                while (run < line.runs.size()
+                        && line.runs.at(run).start + line.runs.at(run).length <= pos)
+                    ++run;
+                const bool formatted = run < line.runs.size() && line.runs.at(run).start <= pos;
+                row[column] = blend(formatted ? line.runs.at(run).color : textColor);
+            }
+            ++column;
+        }
+    }
+    return image;
+}
+
+void DocumentMinimap::startRender()
+{
+    if (m_renderPending || m_dirtyFirst < 0 || m_image.isNull())
+        return;
+
+    const int first = m_dirtyFirst;
+    const int last = m_dirtyLast;
+    m_dirtyFirst = -1;
+    m_dirtyLast = -1;
+
+    // Snapshot the text and colors of the dirty lines; the document can't
+    // be accessed from the worker thread.
+    QVector<MinimapLine> lines(last - first + 1);
+    QTextBlock block = m_editor->document()->findBlockByNumber(first);
+    for (auto &line : lines) {
+        if (!block.isValid())
+            break;
+        line.text = block.text().left(MINIMAP_WIDTH);
+        const auto formats = block.layout()->formats();
+        for (const auto &range : formats) {
+            if (range.start >= line.text.size())
+                continue;
+            const QBrush foreground = range.format.foreground();
+            if (foreground.style() != Qt::NoBrush)
+                line.runs.append({range.start, range.length, foreground.color().rgb()});
+        }
+        std::sort(line.runs.begin(), line.runs.end(),
+                  [](const MinimapRun &left, const MinimapRun &right) {
+            return left.start < right.start;
+        });
+        block = block.next();
+    }
+
+    m_renderPending = true;
+    const quint64 generation = m_generation;
+    const int tabWidth = qMax(1, m_editor->tabWidth());
+    const QRgb textColor = m_textColor.rgb();
+    const QRgb background = m_backgroundColor.rgb();
+    QPointer<DocumentMinimap> guard(this);
+    QThreadPool::globalInstance()->start([=] {
+        const QImage rendered = renderMinimapLines(lines, tabWidth, textColor, background);
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [=] {
+            if (guard)
+                guard->finishRender(generation, first, last, rendered);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void DocumentMinimap::finishRender(quint64 generation, int first, int last,
+                                   const QImage &rendered)
+{
+    m_renderPending = false;
+    if (generation != m_generation) {
+        // The cached rows moved while rendering, so try again
+        invalidate(first, last);
+    } else {
+        QPainter painter(&m_image);
+        painter.drawImage(0, (first - m_firstLine) * MINIMAP_LINE_HEIGHT, rendered);
+        painter.end();
+        update();
+    }
+
+    if (m_dirtyFirst >= 0 && !m_renderTimer->isActive())
+        m_renderTimer->start();
+}
+
+void DocumentMinimap::paintEvent(QPaintEvent *e)
+{
+    QPainter painter(this);
+    painter.fillRect(e->rect(), m_backgroundColor);
+    painter.drawImage(0, 0, m_image);
+
+    // Highlight the part of the document visible in the editor
+    const int firstVisible = m_editor->cursorForPosition(QPoint(0, 0)).blockNumber();
+    const QPoint editorBottom(0, m_editor->viewport()->height() - 1);
+    const int lastVisible = m_editor->cursorForPosition(editorBottom).blockNumber();
+    const int top = (firstVisible - m_firstLine) * MINIMAP_LINE_HEIGHT;
+    const int bottom = (lastVisible - m_firstLine + 1) * MINIMAP_LINE_HEIGHT;
+    painter.fillRect(0, top, width(), bottom - top, m_viewportColor);
+}
+
+void DocumentMinimap::resizeEvent(QResizeEvent *e)
+{
+    QWidget::resizeEvent(e);
+
+    m_image = QImage(MINIMAP_WIDTH, visibleLines() * MINIMAP_LINE_HEIGHT,
+                     QImage::Format_RGB32);
+    m_image.fill(m_backgroundColor);
+    m_firstLine = firstLineForEditor();
+    invalidateAll();
+}
+
+void DocumentMinimap::mousePressEvent(QMouseEvent *e)
+{
+    if (e->button() == Qt::LeftButton)
+        scrollEditorTo(e->pos().y());
+}
+
+void DocumentMinimap::mouseMoveEvent(QMouseEvent *e)
+{
+    if (e->buttons() & Qt::LeftButton)
+        scrollEditorTo(e->pos().y());
+}
+
+void DocumentMinimap::wheelEvent(QWheelEvent *e)
+{
+    QCoreApplication::sendEvent(m_editor->verticalScrollBar(), e);
+}
+
+void DocumentMinimap::scrollEditorTo(int y)
+{
+    // Center the editor on the line under the mouse
+    const QTextDocument *doc = m_editor->document();
+    const int line = qBound(0, m_firstLine + y / MINIMAP_LINE_HEIGHT, doc->blockCount() - 1);
+    const QTextBlock block = doc->findBlockByNumber(line);
+    const int lineSpacing = qMax(1, m_editor->fontMetrics().lineSpacing());
+    const int editorLines = m_editor->viewport()->height() / lineSpacing;
+    m_editor->verticalScrollBar()->setValue(block.firstLineNumber() - editorLines / 2);
+}
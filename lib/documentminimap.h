@@ -0,0 +1,83 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_DOCUMENTMINIMAP_H
+#define QTEXTPAD_DOCUMENTMINIMAP_H
+
+#include <QWidget>
+#include <QImage>
+
+class SyntaxTextEdit;
+class QTimer;
+
+// A scaled-down overview of the document, shown beside the editor.  Each
+// line is drawn at a fixed height, so documents taller than the minimap
+// show a window around the editor's position, which scrolls proportionally
+// with the editor (scaling the whole document down would make long files
+// unreadable).  Only the lines currently covered by the minimap are kept in
+// the image cache, and only lines that changed (or scrolled into view) are
+// re-rendered, on a worker thread.
+class DocumentMinimap : public QWidget
+{
+public:
+    explicit DocumentMinimap(SyntaxTextEdit *editor);
+
+    void setColors(const QColor &text, const QColor &background,
+                   const QColor &viewport);
+
+    QSize sizeHint() const Q_DECL_OVERRIDE;
+
+    // Re-render blocks whose formats were changed by the highlighter
+    void blocksHighlighted(int firstBlock, int lastBlock);
+
+protected:
+    void paintEvent(QPaintEvent *e) Q_DECL_OVERRIDE;
+    void resizeEvent(QResizeEvent *e) Q_DECL_OVERRIDE;
+    void mousePressEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+    void mouseMoveEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+    void wheelEvent(QWheelEvent *e) Q_DECL_OVERRIDE;
+
+private:
+    SyntaxTextEdit *m_editor;
+    QTimer *m_renderTimer;
+    QColor m_textColor, m_backgroundColor, m_viewportColor;
+
+    // Rendered rows for document lines starting at m_firstLine
+    QImage m_image;
+    int m_firstLine;
+    int m_blockCount;
+
+    // Range of document lines that need to be re-rendered
+    int m_dirtyFirst, m_dirtyLast;
+
+    // Renders started before the last scroll, resize or color change are
+    // discarded when they finish.
+    quint64 m_generation;
+    bool m_renderPending;
+
+    int visibleLines() const;
+    int firstLineForEditor() const;
+
+    void documentChanged(int position, int charsRemoved, int charsAdded);
+    void editorScrolled();
+    void invalidate(int first, int last);
+    void invalidateAll();
+    void startRender();
+    void finishRender(quint64 generation, int first, int last, const QImage &rendered);
+    void scrollEditorTo(int y);
+};
+
+#endif  // QTEXTPAD_DOCUMENTMINIMAP_H
@@ -0,0 +1,301 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "documentsearch.h"
+
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DOCUMENT_SEARCH_SSE2
+#endif
+
+// Below this size, setting up the SIMD filter isn't worth it
+#define SEARCH_FILTER_MIN_TEXT  256
+
+// Maps each UTF-16 code unit to the unit it is compared as.  Like
+// QTextDocument::find(), U+00A0 is treated as a space.
+static QVector<ushort> makeFoldTable(bool caseFold)
+{
+    QVector<ushort> table(0x10000);
+    for (uint ch = 0; ch < 0x10000; ++ch) {
+        if (caseFold && !QChar::isSurrogate(ch))
+            table[ch] = ushort(QChar::toCaseFolded(ch));
+        else
+            table[ch] = ushort(ch);
+    }
+    table[QChar::Nbsp] = QLatin1Char(' ').unicode();
+    return table;
+}
+
+static const ushort *foldTable(bool caseSensitive)
+{
+    static const QVector<ushort> s_plain = makeFoldTable(false);
+    static const QVector<ushort> s_folded = makeFoldTable(true);
+    return caseSensitive ? s_plain.constData() : s_folded.constData();
+}
+
+// Find every code unit that maps to unit, padding the unused slots with
+// duplicates.  Returns false if there are too many to check at once.
+static bool filterVariants(const ushort *fold, ushort unit, ushort *variants, int maxVariants)
+{
+    int count = 0;
+    for (uint ch = 0; ch < 0x10000; ++ch) {
+        if (fold[ch] != unit)
+            continue;
+        if (count == maxVariants)
+            return false;
+        variants[count++] = ushort(ch);
+    }
+    for (int i = count; i < maxVariants; ++i)
+        variants[i] = variants[0];
+    return count > 0;
+}
+
+DocumentSearch::DocumentSearch(const QString &text, const QString &searchText,
+                               QTextDocument::FindFlags flags, bool regex)
+    : m_text(text), m_searchText(searchText), m_flags(flags), m_useRegex(regex),
+      m_fold(), m_exactCompare(), m_useFilter()
+{
+    if (m_useRegex) {
+        m_regex.setPattern(searchText);
+        if (!m_flags.testFlag(QTextDocument::FindCaseSensitively))
+            m_regex.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+    } else {
+        initLiteralSearch();
+    }
+}
+
+void DocumentSearch::initLiteralSearch()
+{
+    // A block's text never contains a paragraph separator, and
+    // QTextDocument::find() replaces any U+00A0 in it with a space
+    if (m_searchText.isEmpty() || m_searchText.contains(QChar::ParagraphSeparator)
+            || m_searchText.contains(QChar::Nbsp))
+        return;
+
+    const bool caseSensitive = m_flags.testFlag(QTextDocument::FindCaseSensitively);
+    m_fold = foldTable(caseSensitive);
+    m_pattern.resize(m_searchText.size());
+    bool hasSurrogates = false;
+    for (int i = 0; i < m_searchText.size(); ++i) {
+        const QChar ch = m_searchText.at(i);
+        hasSurrogates = hasSurrogates || ch.isSurrogate();
+        m_pattern[i] = QChar(m_fold[ch.unicode()]);
+    }
+
+    if (!caseSensitive && hasSurrogates) {
+        // Case folding characters outside the BMP needs the full code
+        // point, so leave those to QString
+        m_fallbackText = m_text;
+        m_fallbackText.replace(QChar::Nbsp, QLatin1Char(' '));
+        return;
+    }
+
+    // Without a space to match U+00A0 against, a case sensitive comparison
+    // is just a memcmp()
+    m_exactCompare = caseSensitive && !m_pattern.contains(QLatin1Char(' '));
+
+    const int length = m_pattern.size();
+    for (int &skip : m_skip)
+        skip = length;
+    for (int i = 0; i < length - 1; ++i)
+        m_skip[m_pattern.at(i).unicode() & 0xFF] = length - 1 - i;
+
+#ifdef DOCUMENT_SEARCH_SSE2
+    if (m_text.size() >= SEARCH_FILTER_MIN_TEXT) {
+        m_useFilter = filterVariants(m_fold, m_pattern.at(0).unicode(),
+                                     m_firstVariants, MaxFilterVariants)
+                   && filterVariants(m_fold, m_pattern.at(length - 1).unicode(),
+                                     m_lastVariants, MaxFilterVariants);
+    }
+#endif
+}
+
+DocumentSearch::Match DocumentSearch::find(int pos, bool backward) const
+{
+    const bool wholeWords = m_flags.testFlag(QTextDocument::FindWholeWords);
+
+    if (!m_useRegex) {
+        if (m_pattern.isEmpty())
+            return Match{-1, 0};
+
+        // Matches rejected by the whole word check are skipped along with
+        // the following character, the same as QTextDocument::find()
+        const int length = m_pattern.size();
+        if (backward) {
+            int offset = pos - 1;
+            while (offset >= 0) {
+                const int start = lastIndexOf(offset);
+                if (start < 0)
+                    break;
+                if (wholeWords && !isWholeWord(start, start + length)) {
+                    offset = start - 1;
+                    continue;
+                }
+                return Match{start, length};
+            }
+        } else {
+            int offset = pos;
+            while (offset <= m_text.size()) {
+                const int start = indexOf(offset);
+                if (start < 0)
+                    break;
+                if (wholeWords && !isWholeWord(start, start + length)) {
+                    offset = start + length + 1;
+                    continue;
+                }
+                return Match{start, length};
+            }
+        }
+        return Match{-1, 0};
+    }
+
+    Q_ASSERT(!backward);
+    if (!m_regex.isValid())
+        return Match{-1, 0};
+
+    // Regular expressions are matched against one block at a time, so
+    // anchors and lookarounds see the same text as in QTextDocument::find()
+    int blockStart = (pos > 0) ? m_text.lastIndexOf(QChar::ParagraphSeparator, pos - 1) + 1 : 0;
+    int offset = pos - blockStart;
+    while (blockStart <= m_text.size()) {
+        int blockEnd = m_text.indexOf(QChar::ParagraphSeparator, blockStart);
+        if (blockEnd < 0)
+            blockEnd = m_text.size();
+        QString blockText = QString::fromRawData(m_text.constData() + blockStart,
+                                                 blockEnd - blockStart);
+        if (blockText.contains(QChar::Nbsp))
+            blockText.replace(QChar::Nbsp, QLatin1Char(' '));
+        while (offset <= blockText.size()) {
+            const QRegularExpressionMatch match = m_regex.match(blockText, offset);
+            if (!match.hasMatch())
+                break;
+            const int start = blockStart + match.capturedStart();
+            const int end = blockStart + match.capturedEnd();
+            if (wholeWords && !isWholeWord(start, end)) {
+                offset = end - blockStart + 1;
+                continue;
+            }
+            return Match{start, end - start};
+        }
+        blockStart = blockEnd + 1;
+        offset = 0;
+    }
+    return Match{-1, 0};
+}
+
+DocumentSearch::Match DocumentSearch::findNext(int pos, bool matchFirst) const
+{
+    // Skip over an empty match at the starting position, like safeFindNext()
+    Match match = find(pos);
+    if (match.isValid() && !matchFirst && match.start + match.length == pos) {
+        if (pos >= m_text.size())
+            return Match{-1, 0};
+        match = find(pos + 1);
+    }
+    return match;
+}
+
+int DocumentSearch::indexOf(int from) const
+{
+    if (!m_fallbackText.isNull())
+        return m_fallbackText.indexOf(m_searchText, from, Qt::CaseInsensitive);
+
+    const ushort *text = m_text.utf16();
+    const int length = m_pattern.size();
+    const int lastStart = m_text.size() - length;
+    int pos = from;
+
+#ifdef DOCUMENT_SEARCH_SSE2
+    if (m_useFilter) {
+        const __m128i first0 = _mm_set1_epi16(short(m_firstVariants[0]));
+        const __m128i first1 = _mm_set1_epi16(short(m_firstVariants[1]));
+        const __m128i first2 = _mm_set1_epi16(short(m_firstVariants[2]));
+        const __m128i first3 = _mm_set1_epi16(short(m_firstVariants[3]));
+        const __m128i last0 = _mm_set1_epi16(short(m_lastVariants[0]));
+        const __m128i last1 = _mm_set1_epi16(short(m_lastVariants[1]));
+        const __m128i last2 = _mm_set1_epi16(short(m_lastVariants[2]));
+        const __m128i last3 = _mm_set1_epi16(short(m_lastVariants[3]));
+        for ( ; pos + 8 <= lastStart + 1; pos += 8) {
+            const __m128i firstChars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + pos));
+            const __m128i lastChars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + pos + length - 1));
+            const __m128i firstMatch = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi16(firstChars, first0), _mm_cmpeq_epi16(firstChars, first1)),
+                    _mm_or_si128(_mm_cmpeq_epi16(firstChars, first2), _mm_cmpeq_epi16(firstChars, first3)));
+            const __m128i lastMatch = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi16(lastChars, last0), _mm_cmpeq_epi16(lastChars, last1)),
+                    _mm_or_si128(_mm_cmpeq_epi16(lastChars, last2), _mm_cmpeq_epi16(lastChars, last3)));
+
+            // Two mask bits per UTF-16 code unit
+            uint mask = uint(_mm_movemask_epi8(_mm_and_si128(firstMatch, lastMatch)));
+            while (mask) {
+                const int bit = int(qCountTrailingZeroBits(mask));
+                if (matchesAt(pos + bit / 2))
+                    return pos + bit / 2;
+                mask &= ~(3U << bit);
+            }
+        }
+    }
+#endif
+
+    // Boyer-Moore-Horspool for whatever the filter didn't cover
+    const ushort lastUnit = m_pattern.at(length - 1).unicode();
+    while (pos <= lastStart) {
+        const ushort ch = m_fold[text[pos + length - 1]];
+        if (ch == lastUnit && matchesAt(pos))
+            return pos;
+        pos += m_skip[ch & 0xFF];
+    }
+    return -1;
+}
+
+int DocumentSearch::lastIndexOf(int from) const
+{
+    if (!m_fallbackText.isNull())
+        return m_fallbackText.lastIndexOf(m_searchText, from, Qt::CaseInsensitive);
+
+    const ushort *text = m_text.utf16();
+    const ushort firstUnit = m_pattern.at(0).unicode();
+    for (int pos = qMin(from, m_text.size() - m_pattern.size()); pos >= 0; --pos) {
+        if (m_fold[text[pos]] == firstUnit && matchesAt(pos))
+            return pos;
+    }
+    return -1;
+}
+
+bool DocumentSearch::matchesAt(int pos) const
+{
+    const ushort *text = m_text.utf16() + pos;
+    const ushort *pattern = m_pattern.utf16();
+    const int length = m_pattern.size();
+    if (m_exactCompare)
+        return std::memcmp(text, pattern, length * sizeof(ushort)) == 0;
+    for (int i = 0; i < length; ++i) {
+        if (m_fold[text[i]] != pattern[i])
+            return false;
+    }
+    return true;
+}
+
+bool DocumentSearch::isWholeWord(int start, int end) const
+{
+    return (start == 0 || !m_text.at(start - 1).isLetterOrNumber())
+        && (end == m_text.size() || !m_text.at(end).isLetterOrNumber());
+}
@@ -0,0 +1,85 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_DOCUMENTSEARCH_H
+#define QTEXTPAD_DOCUMENTSEARCH_H
+
+#include <QString>
+#include <QRegularExpression>
+#include <QTextDocument>
+
+// Searches a plain text snapshot of a document, as returned by
+// QTextDocument::toRawText() (blocks are separated by U+2029), with the
+// same matching rules as QTextDocument::find().  Unlike the document
+// itself, the snapshot can be searched from a worker thread.
+//
+// Literal searches scan the whole snapshot at once: candidates are found by
+// comparing the first and last character of the search text against 8
+// positions at a time (with SSE2), and then verified.  Case insensitive
+// searches compare case folded characters.
+class DocumentSearch
+{
+public:
+    struct Match
+    {
+        int start, length;
+
+        bool isValid() const { return start >= 0; }
+        bool operator==(const Match &other) const
+        {
+            return start == other.start && length == other.length;
+        }
+    };
+
+    DocumentSearch(const QString &text, const QString &searchText,
+                   QTextDocument::FindFlags flags, bool regex);
+
+    // Equivalent to QTextDocument::find(searchText, pos, flags).  Backward
+    // searches are only supported for literal text.
+    Match find(int pos, bool backward = false) const;
+
+    // Equivalent to SyntaxTextEdit::textSearch() for a cursor whose
+    // position is pos.  Returns an invalid match if nothing was found.
+    Match findNext(int pos, bool matchFirst) const;
+
+private:
+    enum { MaxFilterVariants = 4 };
+
+    QString m_text;
+    QString m_searchText;
+    QRegularExpression m_regex;
+    QTextDocument::FindFlags m_flags;
+    bool m_useRegex;
+
+    // Literal search state.  m_pattern is m_searchText as it compares to
+    // the text after mapping each character through m_fold.
+    QString m_pattern;
+    const ushort *m_fold;
+    bool m_exactCompare;
+    bool m_useFilter;
+    ushort m_firstVariants[MaxFilterVariants];
+    ushort m_lastVariants[MaxFilterVariants];
+    int m_skip[256];
+    QString m_fallbackText;
+
+    void initLiteralSearch();
+    int indexOf(int from) const;
+    int lastIndexOf(int from) const;
+    bool matchesAt(int pos) const;
+    bool isWholeWord(int start, int end) const;
+};
+
+#endif // QTEXTPAD_DOCUMENTSEARCH_H
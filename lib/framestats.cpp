@@ -0,0 +1,199 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framestats.h"
+
+#include <QPainter>
+#include <QTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QFontDatabase>
+
+#include <algorithm>
+#include <numeric>
+
+// Number of frames used for the percentiles
+#define FRAME_HISTORY           600
+
+// Number of timed events kept for the trace file
+#define TRACE_EVENTS            100000
+
+#define OVERLAY_REFRESH         250
+
+static const char *phaseName(int phase)
+{
+    switch (phase) {
+    case FrameStats::Layout:
+        return "Layout";
+    case FrameStats::TextPaint:
+        return "Text";
+    case FrameStats::Overlays:
+        return "Overlays";
+    case FrameStats::Gutter:
+        return "Gutter";
+    case FrameStats::ExtraSelections:
+        return "Selections";
+    default:
+        return "Total";
+    }
+}
+
+FrameStats::FrameStats()
+    : m_frameCount(), m_eventCount()
+{
+    m_clock.start();
+    m_frames.resize(FRAME_HISTORY);
+}
+
+void FrameStats::beginFrame()
+{
+    Frame &frame = m_frames[m_frameCount % FRAME_HISTORY];
+    std::fill(std::begin(frame.phaseNsecs), std::end(frame.phaseNsecs), 0);
+    m_frameCount += 1;
+}
+
+void FrameStats::addTime(Phase phase, qint64 startNsecs, qint64 nsecs)
+{
+    if (m_frameCount == 0)
+        return;
+    m_frames[(m_frameCount - 1) % FRAME_HISTORY].phaseNsecs[phase] += nsecs;
+
+    const Event event { startNsecs, nsecs, phase };
+    if (m_events.size() < TRACE_EVENTS)
+        m_events.append(event);
+    else
+        m_events[m_eventCount % TRACE_EVENTS] = event;
+    m_eventCount += 1;
+}
+
+qint64 FrameStats::percentile(int phase, int pct) const
+{
+    // The most recent frame may still be in progress
+    const int frames = int(qMin<quint64>(m_frameCount, FRAME_HISTORY + 1)) - 1;
+    if (frames <= 0)
+        return 0;
+
+    const int current = int((m_frameCount - 1) % FRAME_HISTORY);
+    QVector<qint64> samples;
+    samples.reserve(frames);
+    for (int i = 0; i < FRAME_HISTORY && samples.size() < frames; ++i) {
+        if (i == current)
+            continue;
+        const Frame &frame = m_frames.at(i);
+        if (phase < PhaseCount) {
+            samples.append(frame.phaseNsecs[phase]);
+        } else {
+            samples.append(std::accumulate(std::begin(frame.phaseNsecs),
+                                           std::end(frame.phaseNsecs), qint64(0)));
+        }
+    }
+
+    const int index = qMin(samples.size() - 1, (samples.size() * pct) / 100);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples.at(index);
+}
+
+QStringList FrameStats::summary() const
+{
+    auto msecs = [](qint64 nsecs) {
+        return QString::number(nsecs / 1000000.0, 'f', 2).rightJustified(7);
+    };
+
+    QStringList lines;
+    lines << QStringLiteral("%1 frames").arg(m_frameCount);
+    lines << QStringLiteral("%1    p50    p95    p99")
+                .arg(QStringLiteral("(ms)"), -10);
+    for (int phase = 0; phase <= PhaseCount; ++phase) {
+        lines << QStringLiteral("%1%2%3%4")
+                    .arg(QLatin1String(phaseName(phase)), -10)
+                    .arg(msecs(percentile(phase, 50)))
+                    .arg(msecs(percentile(phase, 95)))
+                    .arg(msecs(percentile(phase, 99)));
+    }
+    return lines;
+}
+
+bool FrameStats::saveTrace(const QString &filename) const
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QJsonArray traceEvents;
+    const int eventCount = m_events.size();
+    const int first = (m_eventCount > quint64(eventCount))
+                      ? int(m_eventCount % TRACE_EVENTS) : 0;
+    for (int i = 0; i < eventCount; ++i) {
+        const Event &event = m_events.at((first + i) % eventCount);
+        QJsonObject traceEvent;
+        traceEvent[QStringLiteral("name")] = QLatin1String(phaseName(event.phase));
+        traceEvent[QStringLiteral("ph")] = QStringLiteral("X");
+        traceEvent[QStringLiteral("ts")] = event.start / 1000.0;
+        traceEvent[QStringLiteral("dur")] = event.nsecs / 1000.0;
+        traceEvent[QStringLiteral("pid")] = 1;
+        traceEvent[QStringLiteral("tid")] = 1;
+        traceEvents.append(traceEvent);
+    }
+
+    QJsonObject trace;
+    trace[QStringLiteral("traceEvents")] = traceEvents;
+    trace[QStringLiteral("displayTimeUnit")] = QStringLiteral("ms");
+    return file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact)) >= 0;
+}
+
+
+FrameStatsOverlay::FrameStatsOverlay(const FrameStats *stats, QWidget *parent)
+    : QWidget(parent), m_stats(stats), m_shownFrames()
+{
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+    setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+
+    auto refreshTimer = new QTimer(this);
+    connect(refreshTimer, &QTimer::timeout, this, [this] {
+        if (m_stats->frameCount() != m_shownFrames)
+            update();
+    });
+    refreshTimer->start(OVERLAY_REFRESH);
+}
+
+QSize FrameStatsOverlay::sizeHint() const
+{
+    const QFontMetrics metrics(font());
+    const QStringList lines = m_stats->summary();
+    int width = 0;
+    for (const QString &line : lines)
+        width = qMax(width, metrics.horizontalAdvance(line));
+    return QSize(width + 8, metrics.height() * lines.size() + 8);
+}
+
+void FrameStatsOverlay::paintEvent(QPaintEvent *)
+{
+    m_shownFrames = m_stats->frameCount();
+
+    QPainter painter(this);
+    painter.fillRect(rect(), Qt::black);
+    painter.setPen(Qt::white);
+
+    const QFontMetrics metrics(font());
+    int top = 4 + metrics.ascent();
+    for (const QString &line : m_stats->summary()) {
+        painter.drawText(4, top, line);
+        top += metrics.height();
+    }
+}
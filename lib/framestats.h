@@ -0,0 +1,127 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_FRAMESTATS_H
+#define QTEXTPAD_FRAMESTATS_H
+
+// Frame timing instrumentation for the editor widget.  This is only built
+// when QTEXTPAD_FRAME_STATS is enabled in CMake; otherwise the macros below
+// expand to nothing.
+
+#ifdef QTEXTPAD_FRAME_STATS
+
+#include <QWidget>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QStringList>
+
+class FrameStats
+{
+public:
+    enum Phase
+    {
+        Layout,
+        TextPaint,
+        Overlays,
+        Gutter,
+        ExtraSelections,
+        PhaseCount
+    };
+
+    FrameStats();
+
+    // Starts a new frame.  Everything recorded until the next call is
+    // counted as part of this frame.
+    void beginFrame();
+    void addTime(Phase phase, qint64 startNsecs, qint64 nsecs);
+    qint64 elapsed() const { return m_clock.nsecsElapsed(); }
+    quint64 frameCount() const { return m_frameCount; }
+
+    // Percentile (0-100) of the per-frame time spent in a phase, or of the
+    // total frame time if phase is PhaseCount.
+    qint64 percentile(int phase, int pct) const;
+    QStringList summary() const;
+
+    // Write the recorded events in the Chrome trace event format
+    bool saveTrace(const QString &filename) const;
+
+private:
+    struct Frame
+    {
+        qint64 phaseNsecs[PhaseCount];
+    };
+    struct Event
+    {
+        qint64 start;
+        qint64 nsecs;
+        Phase phase;
+    };
+
+    QElapsedTimer m_clock;
+    QVector<Frame> m_frames;
+    QVector<Event> m_events;
+    quint64 m_frameCount;
+    quint64 m_eventCount;
+};
+
+class FrameStatsScope
+{
+public:
+    FrameStatsScope(FrameStats &stats, FrameStats::Phase phase)
+        : m_stats(stats), m_phase(phase), m_start(stats.elapsed()) { }
+
+    ~FrameStatsScope()
+    {
+        m_stats.addTime(m_phase, m_start, m_stats.elapsed() - m_start);
+    }
+
+private:
+    FrameStats &m_stats;
+    FrameStats::Phase m_phase;
+    qint64 m_start;
+
+    Q_DISABLE_COPY(FrameStatsScope)
+};
+
+// An opaque overlay showing the frame time percentiles.  Since it's opaque,
+// refreshing it doesn't repaint (and therefore record) the editor.
+class FrameStatsOverlay : public QWidget
+{
+public:
+    FrameStatsOverlay(const FrameStats *stats, QWidget *parent);
+
+    QSize sizeHint() const Q_DECL_OVERRIDE;
+
+protected:
+    void paintEvent(QPaintEvent *e) Q_DECL_OVERRIDE;
+
+private:
+    const FrameStats *m_stats;
+    quint64 m_shownFrames;
+};
+
+#define FRAME_STATS_BEGIN_FRAME(stats)  (stats).beginFrame()
+#define FRAME_STATS_SCOPE(stats, phase) \
+    FrameStatsScope frameStatsScope_##phase((stats), FrameStats::phase)
+
+#else
+
+#define FRAME_STATS_BEGIN_FRAME(stats)
+#define FRAME_STATS_SCOPE(stats, phase)
+
+#endif  // QTEXTPAD_FRAME_STATS
+
+#endif  // QTEXTPAD_FRAMESTATS_H
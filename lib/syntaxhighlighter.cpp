@@ -19,8 +19,129 @@
 #include <KSyntaxHighlighting/Theme>
 #include <KSyntaxHighlighting/Definition>
 
+#include <QTextDocument>
+#include <QTextLayout>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QCoreApplication>
+#include <QThreadPool>
+#include <QPointer>
+#include <QTimer>
+
 #include <QRegularExpression>
 
+#include <algorithm>
+
+// Formats are only applied up to this length on extremely long lines
+#define MAX_HIGHLIGHT_LENGTH    20000
+
+// Custom style ID for the whitespace pass, outside the range of Format IDs
+#define WHITESPACE_STYLE_ID     0x10000
+#define STYLE_ID_PROPERTY       (QTextFormat::UserProperty + 1)
+
+#define PROFILE_SLOWEST_BLOCKS  20
+
+// Delay after the last edit before re-analyzing indentation folds
+#define INDENT_FOLD_DELAY       250
+
+struct HighlightProfile
+{
+    struct BlockTiming
+    {
+        int blockNumber;
+        int length;
+        qint64 nsecs;
+    };
+
+    struct StyleStats
+    {
+        QString name;
+        qint64 count = 0;
+        qint64 chars = 0;
+    };
+
+    QElapsedTimer wallTimer;
+    qint64 blocks = 0;
+    qint64 chars = 0;
+    qint64 highlightNsecs = 0;
+    qint64 whitespaceNsecs = 0;
+
+    // Blocks re-highlighted as a result of each document edit
+    qint64 edits = 0;
+    qint64 cascadeBlocks = 0;
+    qint64 maxCascade = 0;
+    qint64 pendingBlocks = 0;
+
+    // Only blocks highlighted while QSyntaxHighlighter handles an edit are
+    // counted, not full rehighlights.
+    bool inEdit = false;
+
+    QVector<BlockTiming> slowestBlocks;
+    QHash<int, StyleStats> styles;
+
+    HighlightProfile() { wallTimer.start(); }
+
+    void addBlock(const BlockTiming &timing)
+    {
+        if (slowestBlocks.size() == PROFILE_SLOWEST_BLOCKS
+                && slowestBlocks.last().nsecs >= timing.nsecs)
+            return;
+        auto iter = std::upper_bound(slowestBlocks.begin(), slowestBlocks.end(), timing,
+                                     [](const BlockTiming &left, const BlockTiming &right) {
+            return left.nsecs > right.nsecs;
+        });
+        slowestBlocks.insert(iter, timing);
+        if (slowestBlocks.size() > PROFILE_SLOWEST_BLOCKS)
+            slowestBlocks.removeLast();
+    }
+};
+
+SyntaxHighlighter::SyntaxHighlighter(QTextDocument *document)
+    : KSyntaxHighlighting::SyntaxHighlighter(static_cast<QObject *>(document)),
+      m_tabCharSize(), m_profile(), m_foldGeneration(), m_requestedGeneration()
+{
+    m_indentFoldTimer = new QTimer(this);
+    m_indentFoldTimer->setSingleShot(true);
+    m_indentFoldTimer->setInterval(INDENT_FOLD_DELAY);
+    connect(m_indentFoldTimer, &QTimer::timeout, this, &SyntaxHighlighter::startIndentFoldAnalysis);
+
+    if (qEnvironmentVariableIsSet("QTEXTPAD_HIGHLIGHT_PROFILE"))
+        setProfilingEnabled(true);
+
+    // The block metadata must be updated for the edit before the
+    // QSyntaxHighlighter re-highlights any of the changed blocks, so this
+    // is connected before the document is attached.
+    m_metadata.reset(document->blockCount());
+    connect(document, &QTextDocument::contentsChange, this, [this](int position, int, int) {
+        if (m_profile) {
+            m_profile->inEdit = true;
+            m_profile->pendingBlocks = 0;
+        }
+        m_metadata.documentChanged(this->document(), position);
+        m_foldGeneration += 1;
+        if (definition().indentationBasedFoldingEnabled())
+            m_indentFoldTimer->start();
+    });
+    setDocument(document);
+
+    // This is connected after QSyntaxHighlighter's own handler, so any
+    // re-highlighting caused by the edit has already happened.
+    connect(document, &QTextDocument::contentsChange, this, [this](int, int, int) {
+        if (!m_profile || !m_profile->inEdit)
+            return;
+        m_profile->inEdit = false;
+        m_profile->edits += 1;
+        m_profile->cascadeBlocks += m_profile->pendingBlocks;
+        m_profile->maxCascade = qMax(m_profile->maxCascade, m_profile->pendingBlocks);
+        m_profile->pendingBlocks = 0;
+    });
+}
+
+SyntaxHighlighter::~SyntaxHighlighter()
+{
+    delete m_profile;
+}
+
 void SyntaxHighlighter::hideBlock(QTextBlock block, bool hide)
 {
     block.setVisible(!hide);
@@ -29,19 +150,19 @@ void SyntaxHighlighter::hideBlock(QTextBlock block, bool hide)
 }
 
 bool SyntaxHighlighter::foldContains(const QTextBlock &foldBlock,
-                                     const QTextBlock &targetBlock) const
+                                     const QTextBlock &targetBlock, FoldQuery query) const
 {
-    if (!isFoldable(foldBlock))
+    if (!isFoldable(foldBlock, query))
         return false;
     return (targetBlock.position() >= foldBlock.position())
-        && (findFoldEnd(foldBlock).position() >= targetBlock.position());
+        && (findFoldEnd(foldBlock, query).position() >= targetBlock.position());
 }
 
-void SyntaxHighlighter::foldBlock(QTextBlock block) const
+void SyntaxHighlighter::foldBlock(QTextBlock block, FoldQuery query) const
 {
     block.setUserState(1);
 
-    const QTextBlock endBlock = findFoldEnd(block);
+    const QTextBlock endBlock = findFoldEnd(block, query);
     block = block.next();
     while (block.isValid() && block != endBlock) {
         hideBlock(block, true);
@@ -49,38 +170,173 @@ void SyntaxHighlighter::foldBlock(QTextBlock block) const
     }
 
     // Only hide the last block if it doesn't also start a new fold region
-    if (block.isValid() && !isFoldable(block))
+    if (block.isValid() && !isFoldable(block, query))
         hideBlock(block, true);
 }
 
-void SyntaxHighlighter::unfoldBlock(QTextBlock block) const
+void SyntaxHighlighter::unfoldBlock(QTextBlock block, FoldQuery query) const
 {
     block.setUserState(-1);
 
-    const QTextBlock endBlock = findFoldEnd(block);
+    const QTextBlock endBlock = findFoldEnd(block, query);
     block = block.next();
     while (block.isValid() && block != endBlock) {
         hideBlock(block, false);
         if (isFolded(block)) {
-            block = findFoldEnd(block);
-            if (block.isValid() && !isFoldable(block))
+            block = findFoldEnd(block, query);
+            if (block.isValid() && !isFoldable(block, query))
                 block = block.next();
         } else {
             block = block.next();
         }
     }
 
-    if (block.isValid() && !isFoldable(block))
+    if (block.isValid() && !isFoldable(block, query))
         hideBlock(block, false);
 }
 
-int SyntaxHighlighter::leadingIndentation(const QString &blockText, int *indentPos) const
+// Updates the visibility of a block, tracking the range of the document
+// that will need to be re-laid out.
+static void setBlockVisible(QTextBlock &block, bool visible,
+                            QTextBlock &dirtyStart, QTextBlock &dirtyEnd)
+{
+    if (block.isVisible() == visible)
+        return;
+    block.setVisible(visible);
+    if (!dirtyStart.isValid())
+        dirtyStart = block;
+    dirtyEnd = block;
+}
+
+static void markBlocksDirty(QTextDocument *document, const QTextBlock &dirtyStart,
+                            const QTextBlock &dirtyEnd)
+{
+    // This lets QPlainTextDocumentLayout fix up the line counts for the
+    // changed visibility and emit a single documentSizeChanged.
+    if (dirtyStart.isValid()) {
+        const int endPosition = dirtyEnd.position() + dirtyEnd.length();
+        document->markContentsDirty(dirtyStart.position(), endPosition - dirtyStart.position());
+    }
+}
+
+template <typename FoldPredicate>
+void SyntaxHighlighter::applyFoldStates(FoldPredicate shouldFold) const
+{
+    updateFoldIndex();
+
+    QTextDocument *doc = document();
+    QTextBlock dirtyStart, dirtyEnd;
+    int hiddenEnd = -1;
+    int blockNumber = 0;
+    for (QTextBlock block = doc->firstBlock(); block.isValid(); block = block.next(), ++blockNumber) {
+        setBlockVisible(block, blockNumber > hiddenEnd, dirtyStart, dirtyEnd);
+
+        const int foldEnd = blockFoldEnd(blockNumber);
+        if (foldEnd == BlockMetadata::NoFold)
+            continue;
+        if (!shouldFold(blockNumber)) {
+            block.setUserState(-1);
+            continue;
+        }
+        block.setUserState(1);
+
+        // Matches foldBlock(): The last block stays visible if it also
+        // starts a new fold region.
+        int lastHidden = foldEnd;
+        if (foldEnd != BlockMetadata::UnterminatedFold
+                && blockFoldEnd(foldEnd) != BlockMetadata::NoFold)
+            lastHidden = foldEnd - 1;
+        hiddenEnd = qMax(hiddenEnd, lastHidden);
+    }
+
+    markBlocksDirty(doc, dirtyStart, dirtyEnd);
+}
+
+void SyntaxHighlighter::foldAll() const
+{
+    applyFoldStates([](int) { return true; });
+}
+
+void SyntaxHighlighter::foldToLevel(int level) const
+{
+    updateFoldTree();
+    applyFoldStates([this, level](int blockNumber) {
+        return m_metadata.foldDepth(blockNumber) >= level;
+    });
+}
+
+void SyntaxHighlighter::foldAllExcept(const QTextBlock &block) const
+{
+    updateFoldTree();
+
+    QVector<bool> keepOpen(m_metadata.size(), false);
+    int foldBlock = block.blockNumber();
+    if (blockFoldEnd(foldBlock) == BlockMetadata::NoFold)
+        foldBlock = m_metadata.foldParent(foldBlock);
+    while (foldBlock >= 0) {
+        keepOpen[foldBlock] = true;
+        foldBlock = m_metadata.foldParent(foldBlock);
+    }
+
+    applyFoldStates([&keepOpen](int blockNumber) {
+        return !keepOpen.at(blockNumber);
+    });
+}
+
+QVector<int> SyntaxHighlighter::foldedBlocks() const
+{
+    updateFoldIndex();
+
+    QVector<int> folded;
+    int blockNumber = 0;
+    for (QTextBlock block = document()->firstBlock(); block.isValid(); block = block.next(), ++blockNumber) {
+        if (isFolded(block) && blockFoldEnd(blockNumber) != BlockMetadata::NoFold)
+            folded.append(blockNumber);
+    }
+    return folded;
+}
+
+void SyntaxHighlighter::foldBlocks(const QVector<int> &blockNumbers) const
+{
+    applyFoldStates([&blockNumbers](int blockNumber) {
+        return std::binary_search(blockNumbers.cbegin(), blockNumbers.cend(), blockNumber);
+    });
+}
+
+QTextBlock SyntaxHighlighter::foldParent(const QTextBlock &block, FoldQuery query) const
+{
+    updateFoldTree(query);
+    const int parent = m_metadata.foldParent(block.blockNumber());
+    return (parent >= 0) ? document()->findBlockByNumber(parent) : QTextBlock();
+}
+
+int SyntaxHighlighter::foldDepth(const QTextBlock &block) const
+{
+    updateFoldTree();
+    return m_metadata.foldDepth(block.blockNumber());
+}
+
+void SyntaxHighlighter::unfoldAll() const
+{
+    QTextDocument *doc = document();
+    QTextBlock dirtyStart, dirtyEnd;
+    for (QTextBlock block = doc->firstBlock(); block.isValid(); block = block.next()) {
+        // Just make everything visible/unfolded regardless of what state
+        // it was previously in.
+        block.setUserState(-1);
+        setBlockVisible(block, true, dirtyStart, dirtyEnd);
+    }
+
+    markBlocksDirty(doc, dirtyStart, dirtyEnd);
+}
+
+static int indentationOf(QStringView blockText, int tabWidth, int *indentPos = Q_NULLPTR)
 {
     int leadingIndent = 0;
     int startOfLine = 0;
     for (const auto ch : blockText) {
         if (ch == QLatin1Char('\t')) {
-            leadingIndent += (m_tabCharSize - (leadingIndent % m_tabCharSize));
+            leadingIndent += (tabWidth - (leadingIndent % tabWidth));
             startOfLine += 1;
         } else if (ch == QLatin1Char(' ')) {
             leadingIndent += 1;
@@ -94,6 +350,34 @@ int SyntaxHighlighter::leadingIndentation(const QString &blockText, int *indentP
     return leadingIndent;
 }
 
+int SyntaxHighlighter::leadingIndentation(const QString &blockText, int *indentPos) const
+{
+    return indentationOf(blockText, m_tabCharSize, indentPos);
+}
+
+int SyntaxHighlighter::blockIndentation(const QTextBlock &block, int *indentPos) const
+{
+    // If the document has changed in an edit block that hasn't finished
+    // yet, the metadata may not match the document's blocks.
+    const int blockNumber = block.blockNumber();
+    if (blockNumber < 0 || m_metadata.size() != document()->blockCount())
+        return leadingIndentation(block.text(), indentPos);
+
+    const auto &data = m_metadata.at(blockNumber);
+    if (!data.indentValid)
+        updateIndentation(blockNumber, block.text());
+    if (indentPos)
+        *indentPos = data.indentPos;
+    return data.indent;
+}
+
+void SyntaxHighlighter::updateIndentation(int blockNumber, const QString &text) const
+{
+    int indentPos;
+    const int indent = leadingIndentation(text, &indentPos);
+    m_metadata.setIndentation(blockNumber, indent, indentPos, isEmptyLine(text));
+}
+
 static QList<QRegularExpression> reCompileAll(const QStringList &regexList)
 {
     QList<QRegularExpression> compiled;
@@ -114,60 +398,449 @@ static bool lineEmpty(const QString &text, const QList<QRegularExpression> &rege
     });
 }
 
-bool SyntaxHighlighter::isFoldable(const QTextBlock &block) const
+const QList<QRegularExpression> &SyntaxHighlighter::foldingIgnoreList() const
 {
-    if (startsFoldingRegion(block))
-        return true;
-    if (definition().indentationBasedFoldingEnabled()) {
-        const auto emptyList = reCompileAll(definition().foldingIgnoreList());
-        if (lineEmpty(block.text(), emptyList))
-            return false;
+    // Compiled once for each definition that's set, including definitions
+    // reloaded from the repository under the same name.
+    if (m_ignoreListDefinition != definition()) {
+        m_ignoreListDefinition = definition();
+        m_foldingIgnoreList = reCompileAll(m_ignoreListDefinition.foldingIgnoreList());
+    }
+    return m_foldingIgnoreList;
+}
+
+bool SyntaxHighlighter::isEmptyLine(const QString &text) const
+{
+    return lineEmpty(text, foldingIgnoreList());
+}
 
-        const int curIndent = leadingIndentation(block.text());
-        QTextBlock nextBlock = block.next();
-        while (nextBlock.isValid() && lineEmpty(nextBlock.text(), emptyList))
-            nextBlock = nextBlock.next();
-        if (nextBlock.isValid() && leadingIndentation(nextBlock.text()) > curIndent)
-            return true;
+void SyntaxHighlighter::setTabWidth(int width)
+{
+    if (m_tabCharSize == width)
+        return;
+    m_tabCharSize = width;
+    m_metadata.invalidateIndentation();
+    m_foldGeneration += 1;
+}
+
+bool SyntaxHighlighter::isFoldable(const QTextBlock &block, FoldQuery query) const
+{
+    updateFoldIndex(query);
+    return blockFoldEnd(block.blockNumber()) != BlockMetadata::NoFold;
+}
+
+QTextBlock SyntaxHighlighter::findFoldEnd(const QTextBlock &startBlock, FoldQuery query) const
+{
+    updateFoldIndex(query);
+    const int endBlock = blockFoldEnd(startBlock.blockNumber());
+    if (endBlock == BlockMetadata::NoFold || endBlock == BlockMetadata::UnterminatedFold)
+        return QTextBlock();
+    return document()->findBlockByNumber(endBlock);
+}
+
+void SyntaxHighlighter::applyFolding(int offset, int length,
+                                     KSyntaxHighlighting::FoldingRegion region)
+{
+    KSyntaxHighlighting::SyntaxHighlighter::applyFolding(offset, length, region);
+
+    // Regions opened and closed on the same line cancel out
+    const quint16 regionId = region.id();
+    if (region.type() == KSyntaxHighlighting::FoldingRegion::Begin) {
+        m_blockFolds.append({regionId, true});
+    } else if (region.type() == KSyntaxHighlighting::FoldingRegion::End) {
+        for (int i = m_blockFolds.size() - 1; i >= 0; --i) {
+            if (m_blockFolds.at(i).regionId == regionId && m_blockFolds.at(i).begin) {
+                m_blockFolds.remove(i);
+                return;
+            }
+        }
+        m_blockFolds.append({regionId, false});
     }
-    return false;
 }
 
-QTextBlock SyntaxHighlighter::findFoldEnd(const QTextBlock &startBlock) const
+struct BlockIndent
 {
-    if (startsFoldingRegion(startBlock))
-        return findFoldingRegionEnd(startBlock);
+    int indent;
+    bool empty;
+};
 
-    if (definition().indentationBasedFoldingEnabled()) {
-        const auto emptyList = reCompileAll(definition().foldingIgnoreList());
+// A block's indentation fold ends at the last non-empty block before the
+// next block with the same or lower indentation.
+static QVector<int> indentFoldEnds(const QVector<BlockIndent> &blocks)
+{
+    QVector<int> foldEnds(blocks.size(), BlockMetadata::NoFold);
 
-        const int curIndent = leadingIndentation(startBlock.text());
-        QTextBlock block = startBlock.next();
-        QTextBlock endBlock;
+    struct IndentLevel { int blockNumber; int indent; };
+    QVector<IndentLevel> indentStack;
+    int lastNonEmpty = -1;
+    auto closeFold = [&foldEnds, &lastNonEmpty](const IndentLevel &level) {
+        if (lastNonEmpty > level.blockNumber)
+            foldEnds[level.blockNumber] = lastNonEmpty;
+    };
+
+    for (int i = 0; i < blocks.size(); ++i) {
+        if (blocks.at(i).empty)
+            continue;
+        const int indent = blocks.at(i).indent;
+        while (!indentStack.isEmpty() && indentStack.last().indent >= indent)
+            closeFold(indentStack.takeLast());
+        indentStack.append({i, indent});
+        lastNonEmpty = i;
+    }
+    while (!indentStack.isEmpty())
+        closeFold(indentStack.takeLast());
+
+    return foldEnds;
+}
+
+void SyntaxHighlighter::startIndentFoldAnalysis()
+{
+    const QTextDocument *doc = document();
+    if (!doc || !definition().indentationBasedFoldingEnabled())
+        return;
+
+    // The worker only sees an immutable snapshot of the text and settings
+    const quint64 generation = m_foldGeneration;
+    const QString text = doc->toRawText();
+    const int tabWidth = m_tabCharSize;
+    const QList<QRegularExpression> ignoreList = foldingIgnoreList();
+    m_requestedGeneration = generation;
+
+    QPointer<SyntaxHighlighter> guard(this);
+    QThreadPool::globalInstance()->start([guard, generation, text, tabWidth, ignoreList] {
+        QVector<BlockIndent> blocks;
+        int start = 0;
         for ( ;; ) {
-            while (block.isValid() && lineEmpty(block.text(), emptyList))
-                block = block.next();
-            if (!block.isValid() || leadingIndentation(block.text()) <= curIndent)
+            int end = text.indexOf(QChar::ParagraphSeparator, start);
+            if (end < 0)
+                end = text.size();
+            const QStringView line = QStringView(text).mid(start, end - start);
+            const bool empty = line.isEmpty()
+                    || (!ignoreList.isEmpty() && lineEmpty(line.toString(), ignoreList));
+            blocks.append({indentationOf(line, tabWidth), empty});
+            if (end == text.size())
                 break;
-            endBlock = block;
-            block = block.next();
+            start = end + 1;
+        }
+
+        auto foldMap = std::make_shared<IndentFoldMap>();
+        foldMap->generation = generation;
+        foldMap->foldEnds = indentFoldEnds(blocks);
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [guard, foldMap] {
+            if (guard)
+                guard->publishIndentFolds(foldMap);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void SyntaxHighlighter::publishIndentFolds(const std::shared_ptr<const IndentFoldMap> &foldMap)
+{
+    // Results for text that has since been edited again are discarded;
+    // another analysis has already been scheduled for the newer text.
+    if (foldMap->generation != m_foldGeneration)
+        return;
+
+    m_indentFolds = foldMap;
+    m_metadata.invalidateFoldTree();
+    Q_EMIT foldsUpdated();
+}
+
+void SyntaxHighlighter::updateFoldIndex(FoldQuery query) const
+{
+    const QTextDocument *doc = document();
+    if (!doc)
+        return;
+
+    if (m_foldDefinition != definition()) {
+        m_foldDefinition = definition();
+        m_foldGeneration += 1;
+        m_indentFolds.reset();
+        m_metadata.invalidateFolds();
+    }
+
+    const bool indentFolding = definition().indentationBasedFoldingEnabled();
+    const bool indentFoldsCurrent = m_indentFolds
+            && m_indentFolds->generation == m_foldGeneration;
+    if (indentFolding && !indentFoldsCurrent) {
+        if (query == CurrentFolds) {
+            // Compute the folds immediately from the cached indentation
+            if (m_metadata.size() != doc->blockCount())
+                m_metadata.resize(doc->blockCount());
+            QVector<BlockIndent> blocks;
+            blocks.reserve(doc->blockCount());
+            int blockNumber = 0;
+            for (QTextBlock block = doc->firstBlock(); block.isValid(); block = block.next(), ++blockNumber) {
+                const auto &data = m_metadata.at(blockNumber);
+                if (!data.indentValid)
+                    updateIndentation(blockNumber, block.text());
+                blocks.append({data.indent, data.empty});
+            }
+
+            auto foldMap = std::make_shared<IndentFoldMap>();
+            foldMap->generation = m_foldGeneration;
+            foldMap->foldEnds = indentFoldEnds(blocks);
+            m_indentFolds = foldMap;
+            m_metadata.invalidateFoldTree();
+        } else if (m_requestedGeneration != m_foldGeneration && !m_indentFoldTimer->isActive()) {
+            m_indentFoldTimer->start();
         }
-        return endBlock;
     }
-    return QTextBlock();
+
+    // Region-based folds:  Each block's fold is defined by the last region
+    // it opens, and ends at the block that closes that region.  Only the
+    // blocks affected by a change are scanned again.
+    if (m_metadata.size() != doc->blockCount())
+        m_metadata.resize(doc->blockCount());
+    m_metadata.updateRegions();
+}
+
+int SyntaxHighlighter::blockFoldEnd(int blockNumber) const
+{
+    const int regionEnd = m_metadata.regionFoldEnd(blockNumber);
+    if (regionEnd != BlockMetadata::NoFold)
+        return regionEnd;
+
+    // Indentation-based folds, from the latest published analysis.  This
+    // may be out of date when painting, so only sane entries are used.
+    if (m_indentFolds && m_indentFolds->foldEnds.size() == m_metadata.size()
+            && blockNumber >= 0 && blockNumber < m_metadata.size()) {
+        const int foldEnd = m_indentFolds->foldEnds.at(blockNumber);
+        if (foldEnd > blockNumber && foldEnd < m_metadata.size())
+            return foldEnd;
+    }
+    return BlockMetadata::NoFold;
+}
+
+void SyntaxHighlighter::updateFoldTree(FoldQuery query) const
+{
+    updateFoldIndex(query);
+    if (!m_metadata.foldTreeDirty())
+        return;
+
+    // Build the fold tree links.  A block that ends one fold and starts
+    // another (e.g. "} else {") is a sibling of the fold it closes.
+    struct OpenFold { int blockNumber; int foldEnd; };
+    QVector<OpenFold> foldStack;
+    const int blockCount = m_metadata.size();
+    for (int i = 0; i < blockCount; ++i) {
+        auto &data = m_metadata[i];
+        const int foldEnd = blockFoldEnd(i);
+        const bool startsFold = (foldEnd != BlockMetadata::NoFold);
+        while (!foldStack.isEmpty() && (foldStack.last().foldEnd < i
+                    || (startsFold && foldStack.last().foldEnd == i)))
+            foldStack.removeLast();
+        data.foldParent = foldStack.isEmpty() ? -1 : foldStack.last().blockNumber;
+        data.foldDepth = foldStack.size();
+        if (startsFold) {
+            data.foldDepth += 1;
+            foldStack.append({i, foldEnd});
+        }
+    }
+
+    m_metadata.setFoldTreeValid();
 }
 
 void SyntaxHighlighter::highlightBlock(const QString &text)
 {
+    QElapsedTimer timer;
+    if (m_profile)
+        timer.start();
+
+    m_blockFolds.clear();
+    // The whole line is always parsed, so that the context state and the
+    // fold markers at the end of the block are correct.  Only the formats
+    // applied to extremely long lines are limited (see applyFormat()).
     KSyntaxHighlighting::SyntaxHighlighter::highlightBlock(text);
+    const int blockNumber = currentBlock().blockNumber();
+    m_metadata.setFoldMarkers(blockNumber, m_blockFolds);
+
+    // Other definitions only need the indentation on request
+    if (definition().indentationBasedFoldingEnabled())
+        updateIndentation(blockNumber, text);
+    else
+        m_metadata.invalidateIndentation(blockNumber);
+
+    qint64 highlightNsecs = 0;
+    if (m_profile)
+        highlightNsecs = timer.nsecsElapsed();
 
     static const QRegularExpression ws_regex(QStringLiteral("\\s+"));
     auto iter = ws_regex.globalMatch(text);
-    QTextCharFormat ws_format;
-    const QBrush ws_brush(theme().editorColor(KSyntaxHighlighting::Theme::TabMarker));
-    ws_format.setForeground(ws_brush);
+    const QTextCharFormat ws_format = styleFormat(WHITESPACE_STYLE_ID);
     while (iter.hasNext()) {
         const auto match = iter.next();
-        setFormat(match.capturedStart(), match.capturedLength(), ws_format);
+        if (match.capturedStart() >= MAX_HIGHLIGHT_LENGTH)
+            break;
+        setFormat(match.capturedStart(),
+                  qMin(match.capturedLength(), MAX_HIGHLIGHT_LENGTH - match.capturedStart()),
+                  ws_format);
+    }
+
+    if (m_profile) {
+        const qint64 totalNsecs = timer.nsecsElapsed();
+        m_profile->blocks += 1;
+        m_profile->chars += text.size();
+        m_profile->highlightNsecs += highlightNsecs;
+        m_profile->whitespaceNsecs += totalNsecs - highlightNsecs;
+        if (m_profile->inEdit)
+            m_profile->pendingBlocks += 1;
+        m_profile->addBlock({currentBlock().blockNumber(), static_cast<int>(text.size()),
+                             totalNsecs});
+    }
+
+    Q_EMIT blocksHighlighted(blockNumber, blockNumber);
+}
+
+void SyntaxHighlighter::applyFormat(int offset, int length,
+                                    const KSyntaxHighlighting::Format &format)
+{
+    if (length == 0 || offset >= MAX_HIGHLIGHT_LENGTH)
+        return;
+    length = qMin(length, MAX_HIGHLIGHT_LENGTH - offset);
+
+    const int styleId = format.id();
+    m_styles.insert(styleId, format);
+    if (m_profile) {
+        auto &stats = m_profile->styles[styleId];
+        if (stats.count == 0)
+            stats.name = format.name();
+        stats.count += 1;
+        stats.chars += length;
+    }
+    setFormat(offset, length, styleFormat(styleId));
+}
+
+void SyntaxHighlighter::setDefinition(const KSyntaxHighlighting::Definition &def)
+{
+    // Style IDs are only meaningful within one repository, and the formats
+    // cached for them may be stale after the repository is reloaded.  The
+    // base class rehighlights the document whenever the definition changes.
+    if (def != definition()) {
+        m_styles.clear();
+        m_palette.clear();
+    }
+    KSyntaxHighlighting::SyntaxHighlighter::setDefinition(def);
+}
+
+QTextCharFormat SyntaxHighlighter::styleFormat(int styleId)
+{
+    auto iter = m_palette.constFind(styleId);
+    if (iter != m_palette.constEnd())
+        return *iter;
+
+    QTextCharFormat charFormat;
+    if (styleId == WHITESPACE_STYLE_ID) {
+        charFormat.setForeground(theme().editorColor(KSyntaxHighlighting::Theme::TabMarker));
+    } else {
+        // This matches the conversion done by KSyntaxHighlighting::SyntaxHighlighter
+        const KSyntaxHighlighting::Format format = m_styles.value(styleId);
+        charFormat.setForeground(format.textColor(theme()));
+        if (format.hasBackgroundColor(theme()))
+            charFormat.setBackground(format.backgroundColor(theme()));
+        if (format.isBold(theme()))
+            charFormat.setFontWeight(QFont::Bold);
+        if (format.isItalic(theme()))
+            charFormat.setFontItalic(true);
+        if (format.isUnderline(theme()))
+            charFormat.setFontUnderline(true);
+        if (format.isStrikeThrough(theme()))
+            charFormat.setFontStrikeOut(true);
+    }
+    charFormat.setProperty(STYLE_ID_PROPERTY, styleId);
+    m_palette.insert(styleId, charFormat);
+    return charFormat;
+}
+
+void SyntaxHighlighter::restyle()
+{
+    m_palette.clear();
+
+    QTextDocument *doc = document();
+    if (!doc)
+        return;
+
+    for (QTextBlock block = doc->firstBlock(); block.isValid(); block = block.next()) {
+        QTextLayout *layout = block.layout();
+        if (!layout)
+            continue;
+        auto ranges = layout->formats();
+        if (ranges.isEmpty())
+            continue;
+        for (auto &range : ranges) {
+            if (range.format.hasProperty(STYLE_ID_PROPERTY))
+                range.format = styleFormat(range.format.intProperty(STYLE_ID_PROPERTY));
+        }
+        layout->setFormats(ranges);
+    }
+    doc->markContentsDirty(0, doc->characterCount());
+    Q_EMIT blocksHighlighted(0, doc->blockCount() - 1);
+}
+
+void SyntaxHighlighter::setProfilingEnabled(bool enabled)
+{
+    if (enabled && !m_profile) {
+        m_profile = new HighlightProfile;
+    } else if (!enabled) {
+        delete m_profile;
+        m_profile = Q_NULLPTR;
+    }
+}
+
+void SyntaxHighlighter::resetProfile()
+{
+    if (m_profile) {
+        delete m_profile;
+        m_profile = new HighlightProfile;
+    }
+}
+
+QJsonObject SyntaxHighlighter::profileReport() const
+{
+    QJsonObject report;
+    if (!m_profile)
+        return report;
+
+    const double highlightMsecs = m_profile->highlightNsecs / 1.0e6;
+    const double whitespaceMsecs = m_profile->whitespaceNsecs / 1.0e6;
+    const double totalSecs = (m_profile->highlightNsecs + m_profile->whitespaceNsecs) / 1.0e9;
+
+    report[QStringLiteral("definition")] = definition().name();
+    report[QStringLiteral("elapsedMs")] = static_cast<double>(m_profile->wallTimer.elapsed());
+    report[QStringLiteral("blocks")] = static_cast<double>(m_profile->blocks);
+    report[QStringLiteral("characters")] = static_cast<double>(m_profile->chars);
+    report[QStringLiteral("highlightMs")] = highlightMsecs;
+    report[QStringLiteral("whitespaceMs")] = whitespaceMsecs;
+    report[QStringLiteral("blocksPerSecond")] = (totalSecs > 0.0) ? m_profile->blocks / totalSecs : 0.0;
+    report[QStringLiteral("edits")] = static_cast<double>(m_profile->edits);
+    report[QStringLiteral("cascadeBlocks")] = static_cast<double>(m_profile->cascadeBlocks);
+    report[QStringLiteral("maxCascade")] = static_cast<double>(m_profile->maxCascade);
+    report[QStringLiteral("averageCascade")] = (m_profile->edits > 0)
+            ? static_cast<double>(m_profile->cascadeBlocks) / m_profile->edits : 0.0;
+
+    QJsonArray slowest;
+    for (const auto &timing : m_profile->slowestBlocks) {
+        QJsonObject block;
+        block[QStringLiteral("line")] = timing.blockNumber + 1;
+        block[QStringLiteral("length")] = timing.length;
+        block[QStringLiteral("ms")] = timing.nsecs / 1.0e6;
+        slowest.append(block);
+    }
+    report[QStringLiteral("slowestLines")] = slowest;
+
+    auto styles = m_profile->styles.values();
+    std::sort(styles.begin(), styles.end(),
+              [](const HighlightProfile::StyleStats &left, const HighlightProfile::StyleStats &right) {
+        return left.count > right.count;
+    });
+    QJsonArray styleList;
+    for (const auto &stats : styles) {
+        QJsonObject style;
+        style[QStringLiteral("name")] = stats.name;
+        style[QStringLiteral("count")] = static_cast<double>(stats.count);
+        style[QStringLiteral("characters")] = static_cast<double>(stats.chars);
+        styleList.append(style);
     }
+    report[QStringLiteral("styles")] = styleList;
+
+    return report;
 }
@@ -18,40 +18,151 @@
 #define QTEXTPAD_SYNTAXHIGHLIGHTER_H
 
 #include <KSyntaxHighlighting/SyntaxHighlighter>
+#include <KSyntaxHighlighting/Format>
+#include <KSyntaxHighlighting/FoldingRegion>
+#include <KSyntaxHighlighting/Definition>
+#include <QTextCharFormat>
+#include <QJsonObject>
+#include <QHash>
+#include <QRegularExpression>
+
+#include <memory>
+
+#include "blockmetadata.h"
+
+struct HighlightProfile;
+class QTimer;
 
 class SyntaxHighlighter : public KSyntaxHighlighting::SyntaxHighlighter
 {
+    Q_OBJECT
+
 public:
-    explicit SyntaxHighlighter(QTextDocument *document)
-        : KSyntaxHighlighting::SyntaxHighlighter(document),
-          m_tabCharSize()
-    { }
+    explicit SyntaxHighlighter(QTextDocument *document);
+    ~SyntaxHighlighter();
 
-    void setTabWidth(int width) { m_tabCharSize = width; }
+    void setTabWidth(int width);
     int tabWidth() const { return m_tabCharSize; }
 
+    void setDefinition(const KSyntaxHighlighting::Definition &def) Q_DECL_OVERRIDE;
+
     static void hideBlock(QTextBlock block, bool hide);
 
+    // Indentation-based folds are computed in the background after edits.
+    // Painting can use the last published result (PublishedFolds), which
+    // may not match the current text.  Anything that changes the fold state
+    // must use the folds for the current text (CurrentFolds).
+    enum FoldQuery { CurrentFolds, PublishedFolds };
+
     static bool isFolded(const QTextBlock &block)
     {
         return block.userState() > 0;
     }
 
-    bool foldContains(const QTextBlock &foldBlock, const QTextBlock &targetBlock) const;
+    bool foldContains(const QTextBlock &foldBlock, const QTextBlock &targetBlock,
+                      FoldQuery query = CurrentFolds) const;
+
+    void foldBlock(QTextBlock block, FoldQuery query = CurrentFolds) const;
+    void unfoldBlock(QTextBlock block, FoldQuery query = CurrentFolds) const;
 
-    void foldBlock(QTextBlock block) const;
-    void unfoldBlock(QTextBlock block) const;
+    // Fold or unfold every block in the document, updating the layout once
+    void foldAll() const;
+    void unfoldAll() const;
+
+    // Fold tree queries.  foldParent() returns the innermost fold enclosing
+    // the block, and foldDepth() the nesting level of the block's fold.
+    QTextBlock foldParent(const QTextBlock &block, FoldQuery query = CurrentFolds) const;
+    int foldDepth(const QTextBlock &block) const;
+
+    // Fold every fold at the specified level (starting at 1) or deeper,
+    // and unfold the rest.
+    void foldToLevel(int level) const;
+
+    // Fold everything except the folds containing the specified block
+    void foldAllExcept(const QTextBlock &block) const;
+
+    // Block numbers of the folded blocks, in document order.  foldBlocks()
+    // replaces the current fold state with the (sorted) list in one pass.
+    QVector<int> foldedBlocks() const;
+    void foldBlocks(const QVector<int> &blockNumbers) const;
 
     int leadingIndentation(const QString &blockText, int *indentPos = nullptr) const;
 
-    bool isFoldable(const QTextBlock &block) const;
-    QTextBlock findFoldEnd(const QTextBlock &startBlock) const;
+    // Same as leadingIndentation(), but uses the block's cached value.
+    // Blocks modified in an unfinished edit block should not use this.
+    int blockIndentation(const QTextBlock &block, int *indentPos = nullptr) const;
+
+    bool isFoldable(const QTextBlock &block, FoldQuery query = CurrentFolds) const;
+    QTextBlock findFoldEnd(const QTextBlock &startBlock, FoldQuery query = CurrentFolds) const;
+
+    // Re-apply the current theme's colors to the existing highlighted
+    // ranges, without re-running the syntax parser.
+    void restyle();
+
+    // Optional instrumentation of the highlighter, which is also enabled at
+    // startup if QTEXTPAD_HIGHLIGHT_PROFILE is set in the environment.
+    void setProfilingEnabled(bool enabled);
+    bool profilingEnabled() const { return m_profile != Q_NULLPTR; }
+    void resetProfile();
+    QJsonObject profileReport() const;
+
+Q_SIGNALS:
+    // Emitted when a background fold analysis changes the published folds
+    void foldsUpdated();
+
+    // Emitted when the formats of a range of blocks are (re)applied, which
+    // may reach past the edited text or happen without any edit at all
+    void blocksHighlighted(int firstBlock, int lastBlock);
 
 protected:
     void highlightBlock(const QString &text) Q_DECL_OVERRIDE;
+    void applyFormat(int offset, int length,
+                     const KSyntaxHighlighting::Format &format) Q_DECL_OVERRIDE;
+    void applyFolding(int offset, int length,
+                      KSyntaxHighlighting::FoldingRegion region) Q_DECL_OVERRIDE;
 
 private:
     int m_tabCharSize;
+    HighlightProfile *m_profile;
+
+    // Highlighted ranges are tagged with a style ID, which maps back to the
+    // KSyntaxHighlighting::Format and its resolved format in the theme
+    QHash<int, KSyntaxHighlighting::Format> m_styles;
+    QHash<int, QTextCharFormat> m_palette;
+
+    QTextCharFormat styleFormat(int styleId);
+
+    // Fold markers are captured from the highlighter and indexed so that
+    // fold queries don't need to scan the document.
+    mutable BlockMetadata m_metadata;
+    QVector<FoldMarker> m_blockFolds;
+    mutable KSyntaxHighlighting::Definition m_foldDefinition;
+
+    struct IndentFoldMap
+    {
+        quint64 generation;
+        QVector<int> foldEnds;
+    };
+    mutable std::shared_ptr<const IndentFoldMap> m_indentFolds;
+    mutable quint64 m_foldGeneration;
+    mutable quint64 m_requestedGeneration;
+    QTimer *m_indentFoldTimer;
+
+    void startIndentFoldAnalysis();
+    void publishIndentFolds(const std::shared_ptr<const IndentFoldMap> &foldMap);
+
+    mutable QList<QRegularExpression> m_foldingIgnoreList;
+    mutable KSyntaxHighlighting::Definition m_ignoreListDefinition;
+
+    const QList<QRegularExpression> &foldingIgnoreList() const;
+    bool isEmptyLine(const QString &text) const;
+    void updateIndentation(int blockNumber, const QString &text) const;
+    void updateFoldIndex(FoldQuery query = CurrentFolds) const;
+    void updateFoldTree(FoldQuery query = CurrentFolds) const;
+    int blockFoldEnd(int blockNumber) const;
+
+    template <typename FoldPredicate>
+    void applyFoldStates(FoldPredicate shouldFold) const;
 };
 
 #endif // QTEXTPAD_SYNTAXHIGHLIGHTER_H
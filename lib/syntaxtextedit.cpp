@@ -15,6 +15,7 @@
  */
 
 #include "syntaxtextedit.h"
+#include "documentminimap.h"
 
 #include <QScrollBar>
 #include <QTextBlock>
@@ -24,6 +25,11 @@
 #include <QStack>
 #include <QStringView>
 #include <QtMath>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QPointer>
+#include <QCoreApplication>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
@@ -40,10 +46,29 @@
 #include <KSyntaxHighlighting/Repository>
 #include <KSyntaxHighlighting/SyntaxHighlighter>
 
+#include <algorithm>
+#include <climits>
 #include <cmath>
 
 #include "syntaxhighlighter.h"
 
+// Blocks longer than this are handled in fixed-size segments, so that cursor
+// movement and column lookups don't need to scan the entire block.
+#define LONG_LINE_THRESHOLD     (16*1024)
+#define LONG_LINE_SEGMENT       ( 4*1024)
+
+// Time spent per slice when laying out wrapped blocks in the background
+#define WRAP_LAYOUT_SLICE       8
+
+// How often the background live search scan reports its progress
+#define SEARCH_SCAN_UPDATE      50
+
+// Delay before restarting an unfinished live search scan after an edit
+#define SEARCH_RESCAN_DELAY     250
+
+// Maximum number of live search matches to paint in a single frame
+#define SEARCH_PAINT_LIMIT      (10*1024)
+
 KSyntaxHighlighting::Repository *SyntaxTextEdit::syntaxRepo()
 {
     static KSyntaxHighlighting::Repository s_syntaxRepo;
@@ -58,12 +83,34 @@ const KSyntaxHighlighting::Definition &SyntaxTextEdit::nullSyntax()
 
 SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
     : QPlainTextEdit(parent), m_tabCharSize(4), m_indentWidth(4),
-      m_longLineMarker(80), m_config(), m_indentationMode(),
-      m_originalFontSize()
+      m_longLineMarker(80), m_longLineOffset(), m_config(), m_indentationMode(),
+      m_originalFontSize(), m_foldIconSize(), m_cursorLineNumber(-1)
 {
+#ifdef QTEXTPAD_FRAME_STATS
+    m_frameStatsOverlay = Q_NULLPTR;
+#endif
     m_lineMargin = new LineMargin(this);
+    m_minimap = Q_NULLPTR;
+    m_wrapLayoutWidth = -1;
+    m_wrapLayoutFirst = m_wrapLayoutLast = m_wrapLayoutNext = 0;
+    m_wrapPendingFirst = m_wrapPendingLast = -1;
+    m_wrapLayoutBlockCount = document()->blockCount();
+    m_wrapLayoutEstimating = false;
+    m_wrapLayoutTimer = new QTimer(this);
+    connect(m_wrapLayoutTimer, &QTimer::timeout, this, &SyntaxTextEdit::continueWrapLayout);
+    m_searchGeneration = 0;
+    m_searchScanEnd = 0;
+    m_searchComplete = true;
+    m_searchScanTimer = new QTimer(this);
+    m_searchScanTimer->setSingleShot(true);
+    m_searchScanTimer->setInterval(SEARCH_RESCAN_DELAY);
+    connect(m_searchScanTimer, &QTimer::timeout, this, &SyntaxTextEdit::startLiveSearchScan);
     m_highlighter = new SyntaxHighlighter(document());
     m_highlighter->setTabWidth(m_tabCharSize);
+    connect(m_highlighter, &SyntaxHighlighter::foldsUpdated, this, [this] {
+        viewport()->update();
+        m_lineMargin->update();
+    });
 
     connect(this, &QPlainTextEdit::blockCountChanged,
             this, &SyntaxTextEdit::updateMargins);
@@ -71,8 +118,12 @@ SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
             this, &SyntaxTextEdit::updateLineNumbers);
     connect(this, &QPlainTextEdit::cursorPositionChanged,
             this, &SyntaxTextEdit::updateCursor);
-    connect(this, &QPlainTextEdit::textChanged,
-            this, &SyntaxTextEdit::updateLiveSearch);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::updateTextSnapshot);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::updateLiveSearchMatches);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::updateWrapLayout);
 
     // Initialize default editor configuration
     QFont fixedFont = QFontDatabase::systemFont(QFontDatabase::FixedFont);
@@ -84,8 +135,51 @@ SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
     QTextOption opt = document()->defaultTextOption();
     opt.setFlags(opt.flags() | QTextOption::AddSpaceForLineAndParagraphSeparators);
     document()->setDefaultTextOption(opt);
+
+#ifdef QTEXTPAD_FRAME_STATS
+    if (qEnvironmentVariableIsSet("QTEXTPAD_FRAME_STATS"))
+        setShowFrameStats(true);
+#endif
 }
 
+SyntaxTextEdit::~SyntaxTextEdit()
+{
+    cancelLiveSearchScan();
+
+#ifdef QTEXTPAD_FRAME_STATS
+    // Allow automated (e.g. offscreen) runs to collect a trace on exit
+    const QString traceFile = qEnvironmentVariable("QTEXTPAD_FRAME_TRACE");
+    if (!traceFile.isEmpty())
+        m_frameStats.saveTrace(traceFile);
+#endif
+}
+
+#ifdef QTEXTPAD_FRAME_STATS
+
+void SyntaxTextEdit::setShowFrameStats(bool show)
+{
+    if (show && !m_frameStatsOverlay) {
+        m_frameStatsOverlay = new FrameStatsOverlay(&m_frameStats, viewport());
+        m_frameStatsOverlay->resize(m_frameStatsOverlay->sizeHint());
+        m_frameStatsOverlay->move(viewport()->width() - m_frameStatsOverlay->width(), 0);
+        m_frameStatsOverlay->show();
+    } else if (!show && m_frameStatsOverlay) {
+        delete m_frameStatsOverlay;
+        m_frameStatsOverlay = Q_NULLPTR;
+    }
+}
+
+bool SyntaxTextEdit::showFrameStats() const
+{
+    return m_frameStatsOverlay != Q_NULLPTR;
+}
+
+bool SyntaxTextEdit::saveFrameTrace(const QString &filename) const
+{
+    return m_frameStats.saveTrace(filename);
+}
+#endif
+
 void SyntaxTextEdit::deleteSelection()
 {
     QTextCursor cursor = textCursor();
@@ -131,7 +225,7 @@ int SyntaxTextEdit::lineMarginWidth() const
 
     if (showFolding()) {
         // Fold markers
-        margin += m_foldOpen.width() + (showLineNumbers() ? qreal(2.0) : qreal(4.0));
+        margin += m_foldIconSize + (showLineNumbers() ? qreal(2.0) : qreal(4.0));
     }
 
     return qCeil(margin);
@@ -161,6 +255,39 @@ bool SyntaxTextEdit::showFolding() const
     return m_config.testFlag(SyntaxTextEdit_Config::ShowFolding);
 }
 
+void SyntaxTextEdit::setShowMinimap(bool show)
+{
+    m_config.setFlag(SyntaxTextEdit_Config::ShowMinimap, show);
+    if (show && !m_minimap) {
+        m_minimap = new DocumentMinimap(this);
+        m_minimap->setColors(palette().color(QPalette::Text), m_editorBg,
+                             m_minimapViewportBg);
+        connect(m_highlighter, &SyntaxHighlighter::blocksHighlighted,
+                m_minimap, &DocumentMinimap::blocksHighlighted);
+        m_minimap->show();
+    } else if (!show && m_minimap) {
+        delete m_minimap;
+        m_minimap = Q_NULLPTR;
+    }
+    updateMargins();
+    updateMinimapGeometry();
+}
+
+bool SyntaxTextEdit::showMinimap() const
+{
+    return m_config.testFlag(SyntaxTextEdit_Config::ShowMinimap);
+}
+
+void SyntaxTextEdit::updateMinimapGeometry()
+{
+    if (!m_minimap)
+        return;
+
+    const QRect viewRect = viewport()->geometry();
+    m_minimap->setGeometry(viewRect.right() + 1, viewRect.top(),
+                           m_minimap->sizeHint().width(), viewRect.height());
+}
+
 void SyntaxTextEdit::setShowWhitespace(bool show)
 {
     QTextOption opt = document()->defaultTextOption();
@@ -205,6 +332,7 @@ bool SyntaxTextEdit::highlightCurrentLine() const
 void SyntaxTextEdit::setTabWidth(int width)
 {
     m_tabCharSize = width;
+    m_longLineSegments.columns.clear();
     m_highlighter->setTabWidth(width);
     updateTabMetrics();
 }
@@ -247,8 +375,15 @@ void SyntaxTextEdit::updateTextMetrics()
         QPointF(0.75 * box, box / 2.0),
     };
 
+    // The fold markers are rendered at the screen's resolution, so they can
+    // be blitted directly without scaling on high-DPI displays.
+    m_foldIconSize = int(box);
+    const qreal dpr = devicePixelRatioF();
+    const int pixmapSize = qCeil(m_foldIconSize * dpr);
+
     QPainter painter;
-    m_foldOpen = QPixmap(box, box);
+    m_foldOpen = QPixmap(pixmapSize, pixmapSize);
+    m_foldOpen.setDevicePixelRatio(dpr);
     m_foldOpen.fill(Qt::transparent);
     painter.begin(&m_foldOpen);
     painter.setRenderHint(QPainter::Antialiasing);
@@ -257,7 +392,8 @@ void SyntaxTextEdit::updateTextMetrics()
     painter.drawPolygon(arrowOpen);
     painter.end();
 
-    m_foldClosed = QPixmap(box, box);
+    m_foldClosed = QPixmap(pixmapSize, pixmapSize);
+    m_foldClosed.setDevicePixelRatio(dpr);
     m_foldClosed.fill(Qt::transparent);
     painter.begin(&m_foldClosed);
     painter.setRenderHint(QPainter::Antialiasing);
@@ -268,6 +404,14 @@ void SyntaxTextEdit::updateTextMetrics()
 
     updateMargins();
     updateTabMetrics();
+    updateLongLineOffset();
+    startWrapLayout();
+}
+
+void SyntaxTextEdit::updateLongLineOffset()
+{
+    const QFontMetricsF fm(font());
+    m_longLineOffset = fm.horizontalAdvance(QString(m_longLineMarker, QLatin1Char('x')));
 }
 
 void SyntaxTextEdit::setIndentationMode(int mode)
@@ -294,6 +438,63 @@ int SyntaxTextEdit::textColumn(const QString &block, int positionInBlock) const
     return column;
 }
 
+static QString blockSegment(const QTextBlock &block, int start, int length)
+{
+    QTextCursor cursor(block);
+    cursor.setPosition(block.position() + start);
+    cursor.setPosition(block.position() + start + length, QTextCursor::KeepAnchor);
+    return cursor.selectedText();
+}
+
+const QVector<int> &SyntaxTextEdit::longLineSegments(const QTextBlock &block) const
+{
+    if (m_longLineSegments.block == block
+            && m_longLineSegments.revision == block.revision()
+            && !m_longLineSegments.columns.isEmpty())
+        return m_longLineSegments.columns;
+
+    const QString blockText = block.text();
+    QVector<int> columns;
+    columns.reserve(blockText.size() / LONG_LINE_SEGMENT + 1);
+    int column = 0;
+    for (int i = 0; i < blockText.size(); ++i) {
+        if ((i % LONG_LINE_SEGMENT) == 0)
+            columns.append(column);
+        if (blockText.at(i) == QLatin1Char('\t'))
+            column = column - (column % m_tabCharSize) + m_tabCharSize;
+        else
+            ++column;
+    }
+    if ((blockText.size() % LONG_LINE_SEGMENT) == 0)
+        columns.append(column);
+
+    m_longLineSegments.block = block;
+    m_longLineSegments.revision = block.revision();
+    m_longLineSegments.columns = columns;
+    return m_longLineSegments.columns;
+}
+
+int SyntaxTextEdit::textColumn(const QTextBlock &block, int positionInBlock) const
+{
+    if (block.length() <= LONG_LINE_THRESHOLD)
+        return textColumn(block.text(), positionInBlock);
+
+    // Only scan the segment containing the requested position
+    const QVector<int> &segments = longLineSegments(block);
+    const int segment = positionInBlock / LONG_LINE_SEGMENT;
+    const int segmentStart = segment * LONG_LINE_SEGMENT;
+    const QString segmentText = blockSegment(block, segmentStart,
+                                             positionInBlock - segmentStart);
+    int column = segments.at(segment);
+    for (const QChar &ch : segmentText) {
+        if (ch == QLatin1Char('\t'))
+            column = column - (column % m_tabCharSize) + m_tabCharSize;
+        else
+            ++column;
+    }
+    return column;
+}
+
 void SyntaxTextEdit::moveCursorTo(int line, int column)
 {
     const auto block = document()->findBlockByNumber(line - 1);
@@ -308,12 +509,25 @@ void SyntaxTextEdit::moveCursorTo(int line, int column)
 
     QTextCursor cursor(block);
     if (column > 0) {
-        const QString blockText = block.text();
+        QString blockText;
         int columnIndex = 0, cursorIndex = 0;
-        for (; cursorIndex < blockText.size(); ++cursorIndex) {
+        if (block.length() > LONG_LINE_THRESHOLD) {
+            // Start scanning from the segment containing the target column
+            const QVector<int> &segments = longLineSegments(block);
+            const auto segIter = std::upper_bound(segments.cbegin(), segments.cend(), column - 1);
+            const int segment = qMax(0, static_cast<int>(segIter - segments.cbegin()) - 1);
+            const int segmentStart = segment * LONG_LINE_SEGMENT;
+            blockText = blockSegment(block, segmentStart,
+                                     qMin(LONG_LINE_SEGMENT, block.length() - 1 - segmentStart));
+            columnIndex = segments.at(segment);
+            cursorIndex = segmentStart;
+        } else {
+            blockText = block.text();
+        }
+        for (int i = 0; i < blockText.size(); ++i, ++cursorIndex) {
             if (columnIndex >= column - 1)
                 break;
-            if (blockText.at(cursorIndex) == QLatin1Char('\t'))
+            if (blockText.at(i) == QLatin1Char('\t'))
                 columnIndex = columnIndex - (columnIndex % m_tabCharSize) + m_tabCharSize;
             else
                 ++columnIndex;
@@ -380,13 +594,7 @@ void SyntaxTextEdit::smartHome(QTextCursor::MoveMode moveMode)
     auto cursor = textCursor();
 
     int leadingIndent = 0;
-    const QString blockText = cursor.block().text();
-    for (const auto ch : blockText) {
-        if (ch.isSpace())
-            leadingIndent += 1;
-        else
-            break;
-    }
+    m_highlighter->blockIndentation(cursor.block(), &leadingIndent);
     int cursorPos = cursor.positionInBlock();
     cursor.movePosition(QTextCursor::StartOfLine, moveMode);
     if (cursor.positionInBlock() == 0 && cursorPos != leadingIndent)
@@ -441,6 +649,7 @@ bool SyntaxTextEdit::showLongLineEdge() const
 void SyntaxTextEdit::setLongLineWidth(int pos)
 {
     m_longLineMarker = pos;
+    updateLongLineOffset();
     viewport()->update();
 }
 
@@ -459,6 +668,117 @@ void SyntaxTextEdit::setWordWrap(bool wrap)
 {
     setWordWrapMode(wrap ? QTextOption::WrapAtWordBoundaryOrAnywhere
                          : QTextOption::NoWrap);
+    startWrapLayout();
+}
+
+// QPlainTextDocumentLayout only lays out blocks as they are painted, and
+// counts every other block as a single line.  With word wrap, that makes
+// the scroll bar wildly inaccurate on large documents.  So in the
+// background, first estimate the line count of each block that hasn't been
+// laid out from its length, then lay out the blocks for real.  Both passes
+// run in short slices on the event loop, so the editor stays responsive.
+void SyntaxTextEdit::startWrapLayout(int firstBlock, int lastBlock)
+{
+    m_wrapLayoutFirst = firstBlock;
+    m_wrapLayoutLast = lastBlock;
+    m_wrapLayoutNext = firstBlock;
+    m_wrapPendingFirst = m_wrapPendingLast = -1;
+    m_wrapLayoutEstimating = true;
+    if (wordWrap())
+        m_wrapLayoutTimer->start();
+    else
+        m_wrapLayoutTimer->stop();
+}
+
+void SyntaxTextEdit::updateWrapLayout(int position, int, int charsAdded)
+{
+    // Changes within a block are laid out by QPlainTextDocumentLayout, so
+    // only added or removed blocks (including newly loaded text) are
+    // measured again, rather than the whole document.
+    const int blockCount = document()->blockCount();
+    const int delta = blockCount - m_wrapLayoutBlockCount;
+    m_wrapLayoutBlockCount = blockCount;
+    if (delta == 0 || !wordWrap())
+        return;
+
+    const int firstBlock = document()->findBlock(position).blockNumber();
+    const int lastBlock = document()->findBlock(position + charsAdded).blockNumber();
+    if (!m_wrapLayoutTimer->isActive()) {
+        startWrapLayout(firstBlock, lastBlock);
+        return;
+    }
+
+    // Keep the running pass on the same blocks, and queue the edited range
+    auto shift = [firstBlock, delta](int &blockNumber) {
+        if (blockNumber > firstBlock && blockNumber != INT_MAX)
+            blockNumber = qMax(firstBlock, blockNumber + delta);
+    };
+    shift(m_wrapLayoutFirst);
+    shift(m_wrapLayoutLast);
+    shift(m_wrapLayoutNext);
+    if (m_wrapPendingFirst < 0) {
+        m_wrapPendingFirst = firstBlock;
+        m_wrapPendingLast = lastBlock;
+    } else {
+        shift(m_wrapPendingFirst);
+        shift(m_wrapPendingLast);
+        m_wrapPendingFirst = qMin(m_wrapPendingFirst, firstBlock);
+        m_wrapPendingLast = qMax(m_wrapPendingLast, lastBlock);
+    }
+}
+
+void SyntaxTextEdit::continueWrapLayout()
+{
+    auto layout = qobject_cast<QPlainTextDocumentLayout *>(document()->documentLayout());
+    if (!layout || !wordWrap()) {
+        m_wrapLayoutTimer->stop();
+        return;
+    }
+
+    const qreal textWidth = viewport()->width() - 2 * document()->documentMargin();
+    const int charsPerLine = qMax(1, int(textWidth / QFontMetricsF(font()).averageCharWidth()));
+
+    QElapsedTimer timer;
+    timer.start();
+    bool sizeChanged = false;
+    {
+        // Only report the new document size once per slice
+        const QSignalBlocker blocker(layout);
+        QTextBlock block = document()->findBlockByNumber(m_wrapLayoutNext);
+        int blockNumber = m_wrapLayoutNext;
+        for (int count = 1; block.isValid() && blockNumber <= m_wrapLayoutLast; ++count) {
+            if (block.isVisible() && block.layout()->lineCount() == 0) {
+                const int oldLineCount = block.lineCount();
+                if (m_wrapLayoutEstimating) {
+                    block.setLineCount(qMax(1, (block.length() + charsPerLine - 1) / charsPerLine));
+                } else {
+                    // Only the line count is kept, so the layouts of the
+                    // whole document aren't held in memory
+                    (void) layout->blockBoundingRect(block);
+                    block.clearLayout();
+                }
+                sizeChanged = sizeChanged || (block.lineCount() != oldLineCount);
+            }
+            block = block.next();
+            ++blockNumber;
+            if ((count % 256) == 0 && timer.elapsed() >= WRAP_LAYOUT_SLICE)
+                break;
+        }
+        m_wrapLayoutNext = (block.isValid() && blockNumber <= m_wrapLayoutLast) ? blockNumber : -1;
+    }
+
+    if (m_wrapLayoutNext < 0) {
+        if (m_wrapLayoutEstimating) {
+            m_wrapLayoutEstimating = false;
+            m_wrapLayoutNext = m_wrapLayoutFirst;
+        } else if (m_wrapPendingFirst >= 0) {
+            startWrapLayout(m_wrapPendingFirst, m_wrapPendingLast);
+        } else {
+            m_wrapLayoutTimer->stop();
+        }
+    }
+    if (sizeChanged)
+        Q_EMIT layout->documentSizeChanged(layout->documentSize());
 }
 
 bool SyntaxTextEdit::wordWrap() const
@@ -466,6 +786,39 @@ bool SyntaxTextEdit::wordWrap() const
     return wordWrapMode() != QTextOption::NoWrap;
 }
 
+static QTextDocument::FindFlags searchFlags(const SyntaxTextEdit::SearchParams &params)
+{
+    QTextDocument::FindFlags flags;
+    if (params.caseSensitive)
+        flags |= QTextDocument::FindCaseSensitively;
+    if (params.wholeWord)
+        flags |= QTextDocument::FindWholeWords;
+    return flags;
+}
+
+static QTextCursor findInDocument(QTextDocument *document, const QRegularExpression &re,
+                                  const QTextCursor &start, QTextDocument::FindFlags flags)
+{
+    return document->find(re, start, flags);
+}
+
+static QTextCursor findInDocument(QTextDocument *document, const DocumentSearch &search,
+                                  const QTextCursor &start, QTextDocument::FindFlags flags)
+{
+    const bool backward = flags.testFlag(QTextDocument::FindBackward);
+    int pos = 0;
+    if (!start.isNull())
+        pos = backward ? start.selectionStart() : start.selectionEnd();
+    const DocumentSearch::Match match = search.find(pos, backward);
+    if (!match.isValid())
+        return QTextCursor();
+
+    QTextCursor cursor(document);
+    cursor.setPosition(match.start);
+    cursor.setPosition(match.start + match.length, QTextCursor::KeepAnchor);
+    return cursor;
+}
+
 template <typename Findable>
 QTextCursor safeFindNext(QTextDocument *document, const Findable &search,
                          const QTextCursor &start, QTextDocument::FindFlags flags,
@@ -475,12 +828,12 @@ QTextCursor safeFindNext(QTextDocument *document, const Findable &search,
     // to find the next match (which could be equal to the skipped cursor).
     // Otherwise, certain types of searches could result in an infinite loop.
 
-    QTextCursor cursor = document->find(search, start, flags);
+    QTextCursor cursor = findInDocument(document, search, start, flags);
     if (cursor == start && !matchFirst) {
         if (cursor.atEnd())
             return QTextCursor();
         cursor.movePosition(QTextCursor::NextCharacter);
-        cursor = document->find(search, cursor, flags);
+        cursor = findInDocument(document, search, cursor, flags);
     }
     return cursor;
 }
@@ -489,11 +842,7 @@ QTextCursor SyntaxTextEdit::textSearch(const QTextCursor &start, const SearchPar
                                        bool matchFirst, bool reverse,
                                        QRegularExpressionMatch *regexMatch)
 {
-    QTextDocument::FindFlags flags;
-    if (params.caseSensitive)
-        flags |= QTextDocument::FindCaseSensitively;
-    if (params.wholeWord)
-        flags |= QTextDocument::FindWholeWords;
+    QTextDocument::FindFlags flags = searchFlags(params);
     if (reverse)
         flags |= QTextDocument::FindBackward;
 
@@ -509,8 +858,58 @@ QTextCursor SyntaxTextEdit::textSearch(const QTextCursor &start, const SearchPar
             *regexMatch = re.match(cursor.selectedText());
         return cursor;
     } else {
-        return safeFindNext(document(), params.searchText, start, flags, matchFirst);
+        const DocumentSearch search(textSnapshot(), params.searchText, flags, false);
+        return safeFindNext(document(), search, start, flags, matchFirst);
+    }
+}
+
+QVector<DocumentSearch::Match> SyntaxTextEdit::findAll(const SearchParams &params,
+                                                       int from, int to)
+{
+    const DocumentSearch search(textSnapshot(), params.searchText,
+                                searchFlags(params), params.regex);
+    QVector<DocumentSearch::Match> matches;
+    auto match = search.findNext(from, true);
+    while (match.isValid() && match.start + match.length <= to) {
+        if (match.length > 0)
+            matches.append(match);
+        match = search.findNext(match.start + match.length, false);
+    }
+    return matches;
+}
+
+const QString &SyntaxTextEdit::textSnapshot()
+{
+    if (m_textSnapshot.isNull())
+        m_textSnapshot = document()->toRawText();
+    return m_textSnapshot;
+}
+
+void SyntaxTextEdit::updateTextSnapshot(int position, int charsRemoved, int charsAdded)
+{
+    if (m_textSnapshot.isNull())
+        return;
+
+    // Patch the edited range instead of taking a new snapshot on the next
+    // search.  Block separators are U+2029 in both toRawText() and the
+    // cursor's selectedText(), so the patched text matches a new snapshot.
+    const int textLength = document()->characterCount() - 1;
+    if (position < 0 || position > m_textSnapshot.size()) {
+        m_textSnapshot = QString();
+        return;
     }
+
+    // Changes that include the document's final block separator report one
+    // more character than the raw text has
+    charsRemoved = qMin(charsRemoved, static_cast<int>(m_textSnapshot.size()) - position);
+    const int addedEnd = qMin(position + charsAdded, textLength);
+
+    QTextCursor cursor(document());
+    cursor.setPosition(position);
+    cursor.setPosition(addedEnd, QTextCursor::KeepAnchor);
+    m_textSnapshot.replace(position, charsRemoved, cursor.selectedText());
+    if (m_textSnapshot.size() != textLength)
+        m_textSnapshot = QString();
 }
 
 void SyntaxTextEdit::setLiveSearch(const SearchParams &params)
@@ -527,30 +926,234 @@ void SyntaxTextEdit::clearLiveSearch()
 
 void SyntaxTextEdit::updateLiveSearch()
 {
-    if (m_searchResults.isEmpty() && m_liveSearch.searchText.isEmpty())
+    cancelLiveSearchScan();
+    m_searchMatches.clear();
+    m_searchScanEnd = 0;
+    m_searchComplete = m_liveSearch.searchText.isEmpty();
+    if (!m_searchComplete) {
+        // Search the visible blocks right away, and leave the rest of the
+        // document to a background scan
+        const QTextBlock lastBlock = cursorForPosition(viewport()->rect().bottomRight()).block();
+        scanLiveSearch(firstVisibleBlock().position(), lastBlock.position() + lastBlock.length());
+        startLiveSearchScan();
+    }
+    viewport()->update();
+    Q_EMIT liveSearchUpdated();
+}
+
+void SyntaxTextEdit::updateLiveSearchMatches(int position, int charsRemoved, int charsAdded)
+{
+    if (m_liveSearch.searchText.isEmpty())
         return;
 
-    m_searchResults.clear();
-    if (!m_liveSearch.searchText.isEmpty()) {
-        auto searchCursor = textCursor();
-        searchCursor.movePosition(QTextCursor::Start);
-        searchCursor = textSearch(searchCursor, m_liveSearch, true);
-        while (!searchCursor.isNull()) {
-            if (searchCursor.hasSelection()) {
-                QTextEdit::ExtraSelection selection;
-                selection.format.setBackground(m_searchBg);
-                selection.cursor = searchCursor;
-                m_searchResults.append(selection);
+    // Matches never span blocks, and each block is searched from its start,
+    // so only matches in the edited blocks can have changed.  Those blocks
+    // are also the ones QPlainTextEdit is already repainting.
+    const QTextDocument *doc = document();
+    const int from = doc->findBlock(position).position();
+    const QTextBlock lastBlock = doc->findBlock(position + charsAdded);
+    const int to = lastBlock.position() + lastBlock.length();
+
+    const int delta = charsAdded - charsRemoved;
+    auto byStart = [](const DocumentSearch::Match &match, int pos) { return match.start < pos; };
+    const auto first = std::lower_bound(m_searchMatches.begin(), m_searchMatches.end(),
+                                        from, byStart);
+    const auto last = std::lower_bound(first, m_searchMatches.end(), to - delta, byStart);
+    const int index = int(first - m_searchMatches.begin());
+    m_searchMatches.erase(first, last);
+    for (auto iter = m_searchMatches.begin() + index; iter != m_searchMatches.end(); ++iter)
+        iter->start += delta;
+    scanLiveSearch(from, to);
+
+    if (!m_searchComplete) {
+        // The background scan is working from an outdated snapshot, so
+        // start it again from the end of what's known to be up to date
+        if (m_searchScanEnd >= to - delta)
+            m_searchScanEnd += delta;
+        else if (m_searchScanEnd > from)
+            m_searchScanEnd = to;
+        cancelLiveSearchScan();
+        m_searchScanTimer->start();
+    }
+    Q_EMIT liveSearchUpdated();
+}
+
+// Search the blocks in [from, to) and replace the matches found there
+void SyntaxTextEdit::scanLiveSearch(int from, int to)
+{
+    QTextCursor cursor(document());
+    cursor.setPosition(from);
+    cursor.setPosition(qMin(to, document()->characterCount()) - 1, QTextCursor::KeepAnchor);
+    const DocumentSearch search(cursor.selectedText(), m_liveSearch.searchText,
+                                searchFlags(m_liveSearch), m_liveSearch.regex);
+
+    QVector<DocumentSearch::Match> matches;
+    auto match = search.findNext(0, true);
+    while (match.isValid()) {
+        if (match.length > 0)
+            matches.append(DocumentSearch::Match{from + match.start, match.length});
+        match = search.findNext(match.start + match.length, false);
+    }
+    replaceLiveSearchMatches(from, to, matches);
+}
+
+void SyntaxTextEdit::replaceLiveSearchMatches(int from, int to,
+                                              const QVector<DocumentSearch::Match> &matches)
+{
+    auto byStart = [](const DocumentSearch::Match &match, int pos) { return match.start < pos; };
+    const auto first = std::lower_bound(m_searchMatches.begin(), m_searchMatches.end(),
+                                        from, byStart);
+    const auto last = std::lower_bound(first, m_searchMatches.end(), to, byStart);
+    const int index = int(first - m_searchMatches.begin());
+    m_searchMatches.erase(first, last);
+
+    if (index == m_searchMatches.size()) {
+        // The usual case for the background scan
+        m_searchMatches += matches;
+    } else {
+        QVector<DocumentSearch::Match> merged;
+        merged.reserve(m_searchMatches.size() + matches.size());
+        merged += m_searchMatches.mid(0, index);
+        merged += matches;
+        merged += m_searchMatches.mid(index);
+        m_searchMatches.swap(merged);
+    }
+}
+
+void SyntaxTextEdit::startLiveSearchScan()
+{
+    cancelLiveSearchScan();
+    const quint64 generation = m_searchGeneration;
+    auto cancelled = std::make_shared<QAtomicInt>(0);
+    m_searchScanCancel = cancelled;
+
+    const QString text = textSnapshot();
+    const QString searchText = m_liveSearch.searchText;
+    const QTextDocument::FindFlags flags = searchFlags(m_liveSearch);
+    const bool regex = m_liveSearch.regex;
+    const int scanStart = m_searchScanEnd;
+
+    QPointer<SyntaxTextEdit> guard(this);
+    QThreadPool::globalInstance()->start([=] {
+        auto post = [guard, generation](int from, int to,
+                                        const QVector<DocumentSearch::Match> &matches,
+                                        bool complete) {
+            QMetaObject::invokeMethod(QCoreApplication::instance(),
+                                      [guard, generation, from, to, matches, complete] {
+                if (guard)
+                    guard->finishLiveSearchScan(generation, from, to, matches, complete);
+            }, Qt::QueuedConnection);
+        };
+
+        const DocumentSearch search(text, searchText, flags, regex);
+        QVector<DocumentSearch::Match> matches;
+        int chunkStart = scanStart;
+        QElapsedTimer timer;
+        timer.start();
+        auto match = search.findNext(scanStart, true);
+        while (match.isValid()) {
+            if (cancelled->loadRelaxed())
+                return;
+            if (match.length > 0)
+                matches.append(match);
+            const int pos = match.start + match.length;
+            if (timer.elapsed() >= SEARCH_SCAN_UPDATE) {
+                post(chunkStart, pos, matches, false);
+                matches.clear();
+                chunkStart = pos;
+                timer.restart();
             }
-            searchCursor = textSearch(searchCursor, m_liveSearch, false);
+            match = search.findNext(pos, false);
         }
+        if (!cancelled->loadRelaxed())
+            post(chunkStart, INT_MAX, matches, true);
+    });
+}
+
+void SyntaxTextEdit::cancelLiveSearchScan()
+{
+    m_searchGeneration += 1;
+    m_searchScanTimer->stop();
+    if (m_searchScanCancel) {
+        m_searchScanCancel->storeRelaxed(1);
+        m_searchScanCancel.reset();
     }
-    updateExtraSelections();
+}
+
+void SyntaxTextEdit::finishLiveSearchScan(quint64 generation, int from, int to,
+                                          const QVector<DocumentSearch::Match> &matches,
+                                          bool complete)
+{
+    if (generation != m_searchGeneration)
+        return;
+
+    replaceLiveSearchMatches(from, to, matches);
+    m_searchScanEnd = to;
+    m_searchComplete = complete;
+    if (complete)
+        m_searchScanCancel.reset();
+
+    const QTextBlock lastBlock = cursorForPosition(viewport()->rect().bottomRight()).block();
+    if (from < lastBlock.position() + lastBlock.length() && to > firstVisibleBlock().position())
+        viewport()->update();
+    Q_EMIT liveSearchUpdated();
+}
+
+int SyntaxTextEdit::liveSearchMatchCount() const
+{
+    return m_searchMatches.size();
+}
+
+bool SyntaxTextEdit::liveSearchComplete() const
+{
+    return m_searchComplete;
+}
+
+int SyntaxTextEdit::liveSearchMatchIndex(const QTextCursor &cursor) const
+{
+    const int start = cursor.selectionStart();
+    const auto iter = std::lower_bound(m_searchMatches.cbegin(), m_searchMatches.cend(), start,
+                                       [](const DocumentSearch::Match &match, int pos) {
+        return match.start < pos;
+    });
+    if (iter == m_searchMatches.cend() || iter->start != start
+            || iter->length != cursor.selectionEnd() - start)
+        return 0;
+    if (start >= m_searchScanEnd)
+        return -1;
+    return int(iter - m_searchMatches.cbegin()) + 1;
+}
+
+static bool sameSelections(const QList<QTextEdit::ExtraSelection> &left,
+                           const QList<QTextEdit::ExtraSelection> &right)
+{
+    return std::equal(left.cbegin(), left.cend(), right.cbegin(), right.cend(),
+                      [](const QTextEdit::ExtraSelection &lhs, const QTextEdit::ExtraSelection &rhs) {
+        return lhs.cursor == rhs.cursor && lhs.format == rhs.format;
+    });
 }
 
 void SyntaxTextEdit::updateExtraSelections()
 {
-    setExtraSelections(m_braceMatch + m_searchResults);
+    // setExtraSelections() repaints every old and new selection, even if
+    // nothing changed (which is the usual case when moving the cursor)
+    FRAME_STATS_SCOPE(m_frameStats, ExtraSelections);
+    if (!sameSelections(m_braceMatch, extraSelections()))
+        setExtraSelections(m_braceMatch);
+}
+
+void SyntaxTextEdit::updateBlockRows(const QTextBlock &block)
+{
+    if (!block.isValid() || !block.isVisible())
+        return;
+
+    const QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
+    const int top = qFloor(blockRect.top());
+    const int bottom = qCeil(blockRect.bottom());
+    if (bottom < 0 || top > viewport()->height())
+        return;
+    viewport()->update(0, top, viewport()->width(), bottom - top + 1);
+    m_lineMargin->update(0, top, m_lineMargin->width(), bottom - top + 1);
 }
 
 void SyntaxTextEdit::setMatchBraces(bool match)
@@ -577,7 +1180,7 @@ bool SyntaxTextEdit::externalUndoRedo() const
 void SyntaxTextEdit::setDefaultFont(const QFont &font)
 {
     // Note:  This will reset the zoom factor to 100%
-    setFont(font);
+    setFont(layoutFont(font));
     m_originalFontSize = font.pointSize();
     updateTextMetrics();
 }
@@ -586,9 +1189,34 @@ QFont SyntaxTextEdit::defaultFont() const
 {
     QFont baseFont = font();
     baseFont.setPointSize(m_originalFontSize);
+    baseFont.setStyleStrategy(QFont::StyleStrategy(baseFont.styleStrategy()
+                                                   & ~QFont::PreferNoShaping));
     return baseFont;
 }
 
+QFont SyntaxTextEdit::layoutFont(QFont font) const
+{
+    // With a fixed-pitch font, most text doesn't need shaping, and skipping
+    // it makes laying out blocks considerably cheaper.
+    int strategy = font.styleStrategy() & ~QFont::PreferNoShaping;
+    if (fastMonospaceLayout() && QFontInfo(font).fixedPitch())
+        strategy |= QFont::PreferNoShaping;
+    font.setStyleStrategy(QFont::StyleStrategy(strategy));
+    return font;
+}
+
+void SyntaxTextEdit::setFastMonospaceLayout(bool enable)
+{
+    m_config.setFlag(SyntaxTextEdit_Config::FastMonospaceLayout, enable);
+    setFont(layoutFont(font()));
+    updateTextMetrics();
+}
+
+bool SyntaxTextEdit::fastMonospaceLayout() const
+{
+    return m_config.testFlag(SyntaxTextEdit_Config::FastMonospaceLayout);
+}
+
 void SyntaxTextEdit::setTheme(const KSyntaxHighlighting::Theme &theme)
 {
     QPalette pal = palette();
@@ -615,13 +1243,17 @@ void SyntaxTextEdit::setTheme(const KSyntaxHighlighting::Theme &theme)
     m_braceMatchBg = theme.editorColor(KSyntaxHighlighting::Theme::BracketMatching);
     m_errorBg = theme.editorColor(KSyntaxHighlighting::Theme::MarkError);
     m_editorBg = theme.editorColor(KSyntaxHighlighting::Theme::BackgroundColor);
+    m_minimapViewportBg = theme.editorColor(KSyntaxHighlighting::Theme::TextSelection);
+    m_minimapViewportBg.setAlpha(96);
+    if (m_minimap) {
+        m_minimap->setColors(pal.color(QPalette::Text), m_editorBg,
+                             m_minimapViewportBg);
+    }
 
+    // Only the colors change, so the existing highlighting can be reused
     m_highlighter->setTheme(theme);
-    m_highlighter->rehighlight();
+    m_highlighter->restyle();
 
-    // Update extra highlights to match the new theme
-    for (auto &result : m_searchResults)
-        result.format.setBackground(m_searchBg);
     updateTextMetrics();
     updateCursor();
 }
@@ -653,9 +1285,30 @@ QString SyntaxTextEdit::syntaxName() const
     return m_highlighter->definition().name();
 }
 
+void SyntaxTextEdit::setHighlightProfiling(bool enable)
+{
+    m_highlighter->setProfilingEnabled(enable);
+}
+
+bool SyntaxTextEdit::highlightProfiling() const
+{
+    return m_highlighter->profilingEnabled();
+}
+
+void SyntaxTextEdit::resetHighlightProfile()
+{
+    m_highlighter->resetProfile();
+}
+
+QJsonObject SyntaxTextEdit::highlightProfile() const
+{
+    return m_highlighter->profileReport();
+}
+
 void SyntaxTextEdit::updateMargins()
 {
-    setViewportMargins(lineMarginWidth(), 0, 0, 0);
+    const int minimapWidth = m_minimap ? m_minimap->sizeHint().width() : 0;
+    setViewportMargins(lineMarginWidth(), 0, minimapWidth, 0);
 }
 
 void SyntaxTextEdit::updateLineNumbers(const QRect &rect, int dy)
@@ -792,18 +1445,20 @@ void SyntaxTextEdit::updateCursor()
     if (matchBraces()) {
         QTextCursor cursor = textCursor();
         cursor.clearSelection();
-        const QString blockText = cursor.block().text();
         const int blockPos = cursor.positionInBlock();
+        const int blockSize = cursor.block().length() - 1;
         const QChar chPrev = (blockPos > 0)
-                             ? blockText[cursor.positionInBlock() - 1]
+                             ? document()->characterAt(cursor.position() - 1)
                              : QLatin1Char(0);
-        const QChar chNext = (blockPos < blockText.size())
-                             ? blockText[cursor.positionInBlock()]
+        const QChar chNext = (blockPos < blockSize)
+                             ? document()->characterAt(cursor.position())
                              : QLatin1Char(0);
         BraceMatchResult match;
-        if (isOpenBrace(chNext)) {
+        // Don't scan through entire long lines looking for a match
+        const bool longLine = (blockSize > LONG_LINE_THRESHOLD);
+        if (!longLine && isOpenBrace(chNext)) {
             match = findNextBrace(cursor.block(), blockPos);
-        } else if (isCloseBrace(chPrev)) {
+        } else if (!longLine && isCloseBrace(chPrev)) {
             match = findPrevBrace(cursor.block(), blockPos);
             cursor.movePosition(QTextCursor::PreviousCharacter);
         }
@@ -824,20 +1479,25 @@ void SyntaxTextEdit::updateCursor()
     updateExtraSelections();
 
     // Ensure the block containing cursor is fully unfolded
+    bool foldsChanged = false;
     QTextBlock cursorBlock = textCursor().block();
     if (!cursorBlock.isVisible()) {
-        QTextBlock block = cursorBlock.previous();
+        // Only the folds enclosing the cursor need to be opened, so follow
+        // the fold tree up from the cursor block instead of scanning back
+        // through the whole document.  This uses the folds for the current
+        // text, since a stale fold range could leave the cursor hidden.
         QStack<QTextBlock> foldStack;
+        QTextBlock block = m_highlighter->foldParent(cursorBlock);
         while (block.isValid()) {
-            if (SyntaxHighlighter::isFolded(block)
-                    && m_highlighter->foldContains(block, cursorBlock))
+            if (SyntaxHighlighter::isFolded(block))
                 foldStack << block;
-            block = block.previous();
+            block = m_highlighter->foldParent(block);
         }
         while (!foldStack.isEmpty())
             m_highlighter->unfoldBlock(foldStack.pop());
         SyntaxHighlighter::hideBlock(cursorBlock, false);
         updateScrollBars();
+        foldsChanged = true;
     }
 
     // If the previous block is folded but the current block is visible, that
@@ -848,6 +1508,7 @@ void SyntaxTextEdit::updateCursor()
         if (m_highlighter->isFoldable(previousBlock)) {
             m_highlighter->unfoldBlock(previousBlock);
             updateScrollBars();
+            foldsChanged = true;
         } else {
             previousBlock.setUserState(-1);
         }
@@ -856,15 +1517,28 @@ void SyntaxTextEdit::updateCursor()
     // Ensure the fold marker for the current line is correct (e.g. in case
     // of deletion or undo/redo actions)
     QTextBlock nextBlock = cursorBlock.next();
-    cursorBlock.setUserState(nextBlock.isVisible() ? -1 : 1);
-
-    // Ensure the entire viewport gets repainted to account for the
-    // "current line" highlight change
-    viewport()->update();
-
-    // Also update the entire line number margin; otherwise word-wrapped lines
-    // may not get the correct block updated
-    m_lineMargin->update();
+    const int foldState = nextBlock.isVisible() ? -1 : 1;
+    const bool foldStateChanged = (cursorBlock.userState() != foldState);
+    cursorBlock.setUserState(foldState);
+
+    // Repaint only the rows of the old and new current lines.  The block
+    // numbers are compared too, since an edit may have removed the block
+    // the cursor was previously on.
+    const QTextBlock oldCursorBlock = m_cursorLineBlock;
+    const bool oldBlockMoved = oldCursorBlock.isValid()
+            && oldCursorBlock.blockNumber() != m_cursorLineNumber;
+    m_cursorLineBlock = cursorBlock;
+    m_cursorLineNumber = cursorBlock.blockNumber();
+    if (foldsChanged || oldBlockMoved) {
+        viewport()->update();
+        m_lineMargin->update();
+    } else if (oldCursorBlock != cursorBlock) {
+        updateBlockRows(oldCursorBlock);
+        updateBlockRows(cursorBlock);
+    } else if (foldStateChanged || showIndentGuides()) {
+        // Indent guides are hidden at the cursor's column
+        updateBlockRows(cursorBlock);
+    }
 }
 
 void SyntaxTextEdit::resizeEvent(QResizeEvent *e)
@@ -874,6 +1548,18 @@ void SyntaxTextEdit::resizeEvent(QResizeEvent *e)
     QRect rect = contentsRect();
     rect.setWidth(lineMarginWidth());
     m_lineMargin->setGeometry(rect);
+    updateMinimapGeometry();
+
+    // A new width means QPlainTextEdit has discarded the wrapped layouts
+    if (viewport()->width() != m_wrapLayoutWidth) {
+        m_wrapLayoutWidth = viewport()->width();
+        startWrapLayout();
+    }
+
+#ifdef QTEXTPAD_FRAME_STATS
+    if (m_frameStatsOverlay)
+        m_frameStatsOverlay->move(viewport()->width() - m_frameStatsOverlay->width(), 0);
+#endif
 }
 
 void SyntaxTextEdit::cutLines()
@@ -910,10 +1596,9 @@ void SyntaxTextEdit::indentSelection()
     cursor.setPosition(startPos);
     do {
         int startOfLine = 0;
-        const QString blockText = cursor.block().text();
-        const int leadingIndent = m_highlighter->leadingIndentation(blockText, &startOfLine);
+        const int leadingIndent = m_highlighter->blockIndentation(cursor.block(), &startOfLine);
 
-        if (!blockText.isEmpty()) {
+        if (cursor.block().length() > 1) {
             cursor.movePosition(QTextCursor::StartOfLine);
             cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor,
                                 startOfLine);
@@ -950,8 +1635,7 @@ void SyntaxTextEdit::outdentSelection()
     cursor.setPosition(startPos);
     do {
         int startOfLine = 0;
-        const QString blockText = cursor.block().text();
-        const int leadingIndent = m_highlighter->leadingIndentation(blockText, &startOfLine);
+        const int leadingIndent = m_highlighter->blockIndentation(cursor.block(), &startOfLine);
 
         cursor.movePosition(QTextCursor::StartOfLine);
         cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor,
@@ -980,10 +1664,12 @@ void SyntaxTextEdit::outdentSelection()
 
 void SyntaxTextEdit::foldCurrentLine()
 {
+    // Fold the cursor's own line if it starts a fold, otherwise the
+    // innermost fold enclosing it
     QTextCursor cursor = textCursor();
     QTextBlock block = cursor.block();
-    while (block.isValid() && !m_highlighter->foldContains(block, cursor.block()))
-        block = block.previous();
+    if (!m_highlighter->isFoldable(block))
+        block = m_highlighter->foldParent(block);
     if (block.isValid() && !SyntaxHighlighter::isFolded(block)) {
         m_highlighter->foldBlock(block);
 
@@ -1002,8 +1688,7 @@ void SyntaxTextEdit::foldCurrentLine()
 void SyntaxTextEdit::unfoldCurrentLine()
 {
     const QTextBlock cursorBlock = textCursor().block();
-    if (m_highlighter->isFoldable(cursorBlock)
-            && SyntaxHighlighter::isFolded(cursorBlock)) {
+    if (SyntaxHighlighter::isFolded(cursorBlock) && m_highlighter->isFoldable(cursorBlock)) {
         m_highlighter->unfoldBlock(cursorBlock);
         viewport()->update();
         m_lineMargin->update();
@@ -1013,43 +1698,57 @@ void SyntaxTextEdit::unfoldCurrentLine()
 
 void SyntaxTextEdit::foldAll()
 {
-    QTextBlock block = document()->begin();
-    while (block.isValid()) {
-        if (m_highlighter->isFoldable(block))
-            m_highlighter->foldBlock(block);
-        block = block.next();
-    }
+    m_highlighter->foldAll();
+    updateAfterFolding();
+}
+
+void SyntaxTextEdit::foldToLevel(int level)
+{
+    m_highlighter->foldToLevel(level);
+    updateAfterFolding();
+}
+
+void SyntaxTextEdit::foldAllExceptCurrent()
+{
+    m_highlighter->foldAllExcept(textCursor().block());
+    updateAfterFolding();
+}
+
+QVector<int> SyntaxTextEdit::foldedBlocks() const
+{
+    return m_highlighter->foldedBlocks();
+}
+
+void SyntaxTextEdit::setFoldedBlocks(const QVector<int> &blockNumbers)
+{
+    m_highlighter->foldBlocks(blockNumbers);
+    updateAfterFolding();
+}
 
+void SyntaxTextEdit::updateAfterFolding()
+{
     // Move the editing cursor if it was in a folded block
     QTextCursor cursor = textCursor();
-    block = cursor.block();
+    QTextBlock block = cursor.block();
     while (block.isValid() && !block.isVisible())
         block = block.previous();
-    if (block.isValid()) {
+    if (block.isValid() && block != cursor.block()) {
         cursor.setPosition(block.position());
         setTextCursor(cursor);
     }
 
+    // The scroll bars are updated by the layout's documentSizeChanged
     viewport()->update();
     m_lineMargin->update();
-    updateScrollBars();
     ensureCursorVisible();
 }
 
 void SyntaxTextEdit::unfoldAll()
 {
-    QTextBlock block = document()->begin();
-    while (block.isValid()) {
-        // Just make everything visible/unfolded regardless of what state
-        // it was previously in.
-        block.setUserState(-1);
-        SyntaxHighlighter::hideBlock(block, false);
-        block = block.next();
-    }
+    m_highlighter->unfoldAll();
 
     viewport()->update();
     m_lineMargin->update();
-    updateScrollBars();
     ensureCursorVisible();
 }
 
@@ -1067,7 +1766,7 @@ void SyntaxTextEdit::zoomOut()
 
 void SyntaxTextEdit::zoomReset()
 {
-    setFont(defaultFont());
+    setFont(layoutFont(defaultFont()));
     updateTextMetrics();
 }
 
@@ -1147,14 +1846,14 @@ void SyntaxTextEdit::keyPressEvent(QKeyEvent *e)
             while (scanCursor.blockNumber() > 0 && startOfLine == 0) {
                 scanCursor.movePosition(QTextCursor::PreviousBlock);
 
-                const QString blockText = scanCursor.block().text();
-                for (const auto ch : blockText) {
-                    if (ch.isSpace())
-                        startOfLine += 1;
-                    else
-                        break;
-                }
-                if (startOfLine == 0 && !blockText.isEmpty()) {
+                // The block that was just split is still part of the open
+                // edit block, so its cached indentation is out of date.
+                const QTextBlock block = scanCursor.block();
+                if (block.next() == textCursor().block())
+                    m_highlighter->leadingIndentation(block.text(), &startOfLine);
+                else
+                    m_highlighter->blockIndentation(block, &startOfLine);
+                if (startOfLine == 0 && block.length() > 1) {
                     // No leading whitespace, but line is not empty.
                     // Therefore, current leading indent level is 0.
                     break;
@@ -1298,7 +1997,40 @@ void SyntaxTextEdit::wheelEvent(QWheelEvent *e)
 
 void SyntaxTextEdit::paintEvent(QPaintEvent *e)
 {
-    const QRect eventRect = e->rect();
+    FRAME_STATS_BEGIN_FRAME(m_frameStats);
+#ifdef QTEXTPAD_FRAME_STATS
+    {
+        // Lay out the visible blocks up front, so the layout time isn't
+        // counted as part of painting the text
+        FRAME_STATS_SCOPE(m_frameStats, Layout);
+        for (QTextBlock block = firstVisibleBlock(); block.isValid(); block = block.next()) {
+            const QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
+            if (blockRect.top() > e->rect().bottom())
+                break;
+        }
+    }
+#endif
+
+    {
+        FRAME_STATS_SCOPE(m_frameStats, Overlays);
+        paintBackgroundLayers(e->rect());
+    }
+    {
+        FRAME_STATS_SCOPE(m_frameStats, TextPaint);
+        QPlainTextEdit::paintEvent(e);
+    }
+
+    // Overlay indentation guides after rendering the text
+    if (showIndentGuides()) {
+        FRAME_STATS_SCOPE(m_frameStats, Overlays);
+        paintIndentGuides(e->rect());
+    }
+}
+
+void SyntaxTextEdit::paintBackgroundLayers(const QRect &eventRect)
+{
+    // All of these layers are limited to the damaged area, so e.g. a caret
+    // blink only repaints the few pixels around the caret.
     const QRect viewRect = viewport()->rect();
     QRectF cursorBlockRect;
 
@@ -1317,96 +2049,162 @@ void SyntaxTextEdit::paintEvent(QPaintEvent *e)
         cursorBlockRect.translate(contentOffset());
         cursorBlockRect.setLeft(eventRect.left());
         cursorBlockRect.setWidth(eventRect.width());
-        if (eventRect.intersects(cursorBlockRect.toAlignedRect())) {
-            QPainter p(viewport());
+        if (eventRect.intersects(cursorBlockRect.toAlignedRect()))
             p.fillRect(cursorBlockRect, m_cursorLineBg);
-        }
     }
 
     if (showLongLineEdge() && m_longLineMarker > 0) {
-        QFontMetricsF fm(font());
-        const qreal longLinePos =
-                fm.horizontalAdvance(QString(m_longLineMarker, QLatin1Char('x')))
-                + contentOffset().x() + document()->documentMargin();
-        if (longLinePos < viewRect.width()) {
-            QPainter p(viewport());
-            QRectF longLineRect(longLinePos, eventRect.top(),
-                                viewRect.width() - longLinePos, eventRect.height());
+        const qreal longLinePos = m_longLineOffset + contentOffset().x()
+                                + document()->documentMargin();
+        if (longLinePos < viewRect.width() && longLinePos <= eventRect.right() + 1) {
+            const qreal longLineLeft = qMax<qreal>(longLinePos, eventRect.left());
+            QRectF longLineRect(longLineLeft, eventRect.top(),
+                                eventRect.right() + 1 - longLineLeft, eventRect.height());
             p.fillRect(longLineRect, m_longLineBg);
             if (longLineRect.intersects(cursorBlockRect))
                 p.fillRect(cursorBlockRect.intersected(longLineRect), m_longLineCursorBg);
-            p.setPen(m_longLineEdge);
-            p.drawLine(longLinePos, eventRect.top(), longLinePos, eventRect.bottom());
+            if (longLinePos >= eventRect.left()) {
+                p.setPen(m_longLineEdge);
+                p.drawLine(longLinePos, eventRect.top(), longLinePos, eventRect.bottom());
+            }
         }
     }
 
     QTextBlock block = firstVisibleBlock();
+    int searchPaintLimit = SEARCH_PAINT_LIMIT;
+    p.setPen(QPen(m_codeFoldingBg, 1.0, Qt::DashLine));
     while (block.isValid()) {
         QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
         if (blockRect.top() > eventRect.bottom())
             break;
 
-        if (m_highlighter->isFoldable(block) && SyntaxHighlighter::isFolded(block)) {
-            QPainter p(viewport());
-            blockRect.setLeft(eventRect.left());
-            blockRect.setRight(eventRect.right());
-            p.setPen(QPen(m_codeFoldingBg, 1.0, Qt::DashLine));
-            // The line is drawn one pixel up from the bottom to avoid getting
-            // missed when scrolling the line into view from the top...
-            p.drawLine(blockRect.left(), blockRect.bottom() - 1,
-                       blockRect.right(), blockRect.bottom() - 1);
-            block = m_highlighter->findFoldEnd(block);
+        if (!m_searchMatches.isEmpty() && blockRect.bottom() >= eventRect.top())
+            paintSearchMatches(p, block, blockRect.topLeft(), searchPaintLimit);
+
+        if (m_highlighter->isFoldable(block, SyntaxHighlighter::PublishedFolds)
+                && SyntaxHighlighter::isFolded(block)) {
+            if (blockRect.bottom() >= eventRect.top()) {
+                blockRect.setLeft(eventRect.left());
+                blockRect.setRight(eventRect.right());
+                // The line is drawn one pixel up from the bottom to avoid getting
+                // missed when scrolling the line into view from the top...
+                p.drawLine(blockRect.left(), blockRect.bottom() - 1,
+                           blockRect.right(), blockRect.bottom() - 1);
+            }
+            block = m_highlighter->findFoldEnd(block, SyntaxHighlighter::PublishedFolds);
         } else {
             block = block.next();
         }
     }
+}
 
-    QPlainTextEdit::paintEvent(e);
+void SyntaxTextEdit::paintSearchMatches(QPainter &painter, const QTextBlock &block,
+                                        const QPointF &offset, int &paintLimit)
+{
+    const int blockStart = block.position();
+    const int blockEnd = blockStart + block.length();
+    auto iter = std::lower_bound(m_searchMatches.cbegin(), m_searchMatches.cend(), blockStart,
+                                 [](const DocumentSearch::Match &match, int pos) {
+        return match.start < pos;
+    });
 
-    // Overlay indentation guides after rendering the text
-    if (showIndentGuides()) {
-        QPainter p(viewport());
-        p.setPen(m_indentGuideFg);
-        block = firstVisibleBlock();
-        const QFontMetricsF fm(font());
-        const int guideWidth = (m_indentationMode == IndentTabs
-                                ? m_tabCharSize : m_indentWidth);
-        const qreal indentLine = indentAdvance(fm, guideWidth);
-        const qreal lineOffset = contentOffset().x() + document()->documentMargin();
-        while (block.isValid()) {
-            QString blockText = block.text();
-            int wsColumn = 0;
-            bool onlySpaces = true;
-            for (const QChar &ch : std::as_const(blockText)) {
-                if (ch == QLatin1Char('\t')) {
-                    wsColumn = wsColumn - (wsColumn % m_tabCharSize) + m_tabCharSize;
-                } else if (ch.isSpace()) {
-                    ++wsColumn;
-                } else {
-                    onlySpaces = false;
-                    break;
-                }
-            }
-            if (onlySpaces) {
-                // Pretend we have one more column so whitespace-only lines
-                // show the indent guideline when applicable
-                wsColumn += 1;
-            }
-            QRectF blockRect = blockBoundingGeometry(block);
-            blockRect.translate(contentOffset());
-            wsColumn = (wsColumn + guideWidth - 1) / guideWidth;
-            for (int i = 1; i < wsColumn; ++i) {
-                if (cursor.blockNumber() == block.blockNumber()
-                        && cursor.positionInBlock() == (guideWidth * i))
-                     continue;
-
-                const qreal lineX = (indentLine * i) + lineOffset;
-                p.drawLine(QPointF(lineX, blockRect.top()),
-                           QPointF(lineX, blockRect.bottom()));
-            }
+    const QTextLayout *layout = block.layout();
+    if (layout->lineCount() == 0)
+        return;
+    for ( ; iter != m_searchMatches.cend() && iter->start < blockEnd; ++iter) {
+        if (paintLimit-- <= 0)
+            return;
+
+        // A match may be split across several wrapped lines
+        const int matchStart = iter->start - blockStart;
+        const int matchEnd = matchStart + iter->length;
+        const int lastLine = layout->lineForTextPosition(matchEnd).lineNumber();
+        for (int i = layout->lineForTextPosition(matchStart).lineNumber(); i <= lastLine; ++i) {
+            const QTextLine line = layout->lineAt(i);
+            if (!line.isValid())
+                break;
+            const qreal left = line.cursorToX(qMax(matchStart, line.textStart()));
+            const qreal right = line.cursorToX(qMin(matchEnd, line.textStart() + line.textLength()));
+            if (left == right)
+                continue;
+            painter.fillRect(QRectF(offset.x() + qMin(left, right), offset.y() + line.y(),
+                                    qAbs(right - left), line.height()), m_searchBg);
+        }
+    }
+}
+
+void SyntaxTextEdit::paintIndentGuides(const QRect &eventRect)
+{
+    QPainter p(viewport());
+    p.setPen(m_indentGuideFg);
+    const QTextCursor cursor = textCursor();
+    QTextBlock block = firstVisibleBlock();
+    const QFontMetricsF fm(font());
+    const int guideWidth = (m_indentationMode == IndentTabs
+                            ? m_tabCharSize : m_indentWidth);
+    const qreal indentLine = indentAdvance(fm, guideWidth);
+    const qreal lineOffset = contentOffset().x() + document()->documentMargin();
+    while (block.isValid()) {
+        // Only the last block of a fold can be hidden here
+        if (!block.isVisible()) {
+            block = block.next();
+            continue;
+        }
+
+        QRectF blockRect = blockBoundingGeometry(block);
+        blockRect.translate(contentOffset());
+        if (blockRect.top() > eventRect.bottom())
+            break;
+
+        if (blockRect.bottom() >= eventRect.top())
+            paintBlockIndentGuides(p, block, blockRect, cursor, guideWidth, indentLine, lineOffset);
+
+        if (SyntaxHighlighter::isFolded(block)
+                && m_highlighter->isFoldable(block, SyntaxHighlighter::PublishedFolds))
+            block = m_highlighter->findFoldEnd(block, SyntaxHighlighter::PublishedFolds);
+        else
             block = block.next();
+    }
+}
+
+void SyntaxTextEdit::paintBlockIndentGuides(QPainter &painter, const QTextBlock &block,
+                                            const QRectF &blockRect, const QTextCursor &cursor,
+                                            int guideWidth, qreal indentLine, qreal lineOffset)
+{
+    int indentPos;
+    int wsColumn = m_highlighter->blockIndentation(block, &indentPos);
+
+    // The cached indentation only includes tabs and spaces, but any other
+    // whitespace also extends the guides
+    if (indentPos < block.length() - 1
+            && document()->characterAt(block.position() + indentPos).isSpace()) {
+        const QString blockText = block.text();
+        for ( ; indentPos < blockText.size(); ++indentPos) {
+            const QChar ch = blockText.at(indentPos);
+            if (ch == QLatin1Char('\t'))
+                wsColumn = wsColumn - (wsColumn % m_tabCharSize) + m_tabCharSize;
+            else if (ch.isSpace())
+                ++wsColumn;
+            else
+                break;
         }
     }
+
+    if (indentPos == block.length() - 1) {
+        // Pretend we have one more column so whitespace-only lines
+        // show the indent guideline when applicable
+        wsColumn += 1;
+    }
+    wsColumn = (wsColumn + guideWidth - 1) / guideWidth;
+    for (int i = 1; i < wsColumn; ++i) {
+        if (cursor.blockNumber() == block.blockNumber()
+                && cursor.positionInBlock() == (guideWidth * i))
+             continue;
+
+        const qreal lineX = (indentLine * i) + lineOffset;
+        painter.drawLine(QPointF(lineX, blockRect.top()),
+                         QPointF(lineX, blockRect.bottom()));
+    }
 }
 
 void SyntaxTextEdit::printDocument(QPrinter *printer)
@@ -1453,16 +2251,74 @@ void SyntaxTextEdit::updateScrollBars()
 
 SyntaxTextEdit::LineMargin::LineMargin(SyntaxTextEdit *editor)
     : QWidget(editor), m_editor(editor), m_marginSelectStart(-1),
-      m_foldHoverLine(-1)
+      m_foldHoverLine(-1), m_digitAdvance(), m_digitCellWidth(), m_digitHeight()
 {
     setMouseTracking(true);
 }
 
+void SyntaxTextEdit::LineMargin::updateDigitGlyphs()
+{
+    const qreal dpr = devicePixelRatioF();
+    const QColor &numberColor = m_editor->m_lineMarginFg;
+    const QColor &cursorNumberColor = m_editor->m_cursorLineNum;
+    if (!m_digitGlyphs.isNull() && m_digitGlyphs.devicePixelRatio() == dpr
+            && m_digitFont == font() && m_digitColors[0] == numberColor
+            && m_digitColors[1] == cursorNumberColor)
+        return;
+
+    m_digitFont = font();
+    m_digitColors[0] = numberColor;
+    m_digitColors[1] = cursorNumberColor;
+
+    const QFontMetricsF metrics(m_digitFont);
+    qreal cellWidth = 0;
+    for (int digit = 0; digit < 10; ++digit) {
+        const QChar ch = QLatin1Char('0' + digit);
+        m_digitAdvance[digit] = metrics.horizontalAdvance(ch);
+        cellWidth = qMax(cellWidth, qMax(m_digitAdvance[digit], metrics.boundingRect(ch).right()));
+    }
+    m_digitCellWidth = qCeil(cellWidth) + 1;
+    m_digitHeight = qCeil(metrics.height());
+
+    // One row of digits per color
+    m_digitGlyphs = QPixmap(qCeil(m_digitCellWidth * 10 * dpr), qCeil(m_digitHeight * 2 * dpr));
+    m_digitGlyphs.setDevicePixelRatio(dpr);
+    m_digitGlyphs.fill(Qt::transparent);
+
+    QPainter painter(&m_digitGlyphs);
+    painter.setFont(m_digitFont);
+    for (int row = 0; row < 2; ++row) {
+        painter.setPen(m_digitColors[row]);
+        for (int digit = 0; digit < 10; ++digit) {
+            painter.drawText(QPointF(digit * m_digitCellWidth, row * m_digitHeight + metrics.ascent()),
+                             QString(QLatin1Char('0' + digit)));
+        }
+    }
+}
+
+void SyntaxTextEdit::LineMargin::drawLineNumber(QPainter &painter, qreal right, qreal top,
+                                                int lineNum, bool cursorLine)
+{
+    const qreal dpr = m_digitGlyphs.devicePixelRatio();
+    const int row = cursorLine ? 1 : 0;
+    qreal left = right;
+    do {
+        const int digit = lineNum % 10;
+        left -= m_digitAdvance[digit];
+        const QRectF source(digit * m_digitCellWidth * dpr, row * m_digitHeight * dpr,
+                            m_digitCellWidth * dpr, m_digitHeight * dpr);
+        painter.drawPixmap(QRectF(left, top, m_digitCellWidth, m_digitHeight),
+                           m_digitGlyphs, source);
+        lineNum /= 10;
+    } while (lineNum > 0);
+}
+
 void SyntaxTextEdit::LineMargin::paintEvent(QPaintEvent *paintEvent)
 {
     if (!m_editor->showLineNumbers() && !m_editor->showFolding())
         return;
 
+    FRAME_STATS_SCOPE(m_editor->m_frameStats, Gutter);
     QPainter painter(this);
     painter.fillRect(paintEvent->rect(), m_editor->m_lineMarginBg);
 
@@ -1471,30 +2327,31 @@ void SyntaxTextEdit::LineMargin::paintEvent(QPaintEvent *paintEvent)
                             .translated(m_editor->contentOffset()).top();
     qreal bottom = top + m_editor->blockBoundingRect(block).height();
     const QFontMetricsF metrics(font());
-    const int foldPixmapWidth = m_editor->m_foldOpen.width() + 2;
+    const int foldPixmapWidth = m_editor->m_foldIconSize + 2;
     const qreal numOffset = metrics.boundingRect(QLatin1Char('0')).width() / 2.0
                           + (m_editor->showFolding() ? foldPixmapWidth : 0);
-    QTextCursor cursor = m_editor->textCursor();
+    const int cursorBlockNumber = m_editor->textCursor().blockNumber();
+    if (m_editor->showLineNumbers())
+        updateDigitGlyphs();
 
+    // Block numbers are counted from the first visible block, rather than
+    // looking up each block's number in the document.
+    int blockNumber = block.blockNumber();
     while (block.isValid() && top <= paintEvent->rect().bottom()) {
         if (block.isVisible()) {
             if (m_editor->showLineNumbers() && bottom >= paintEvent->rect().top()) {
-                const QString lineNum = QString::number(block.blockNumber() + 1);
-                if (block.blockNumber() == cursor.blockNumber())
-                    painter.setPen(m_editor->m_cursorLineNum);
-                else
-                    painter.setPen(m_editor->m_lineMarginFg);
-                const QRectF numberRect(0, top, width() - numOffset,
-                                        metrics.height());
-                painter.drawText(numberRect, Qt::AlignRight, lineNum);
+                drawLineNumber(painter, width() - numOffset, top, blockNumber + 1,
+                               blockNumber == cursorBlockNumber);
             }
 
-            if (m_editor->showFolding() && m_editor->m_highlighter->isFoldable(block)) {
+            if (m_editor->showFolding()
+                    && m_editor->m_highlighter->isFoldable(block, SyntaxHighlighter::PublishedFolds)) {
                 const bool blockFolded = SyntaxHighlighter::isFolded(block);
-                if (block.blockNumber() == m_foldHoverLine) {
+                if (blockNumber == m_foldHoverLine) {
                     const int foldHighlightLeft = width() - foldPixmapWidth
                                                 - (m_editor->showLineNumbers() ? 2 : 0);
-                    QTextBlock endBlock = m_editor->m_highlighter->findFoldEnd(block);
+                    QTextBlock endBlock = m_editor->m_highlighter->findFoldEnd(block,
+                                                        SyntaxHighlighter::PublishedFolds);
                     if (!endBlock.isValid())
                         endBlock = m_editor->document()->lastBlock();
                     const qreal foldHighlightBottom = blockFolded ? bottom
@@ -1506,13 +2363,14 @@ void SyntaxTextEdit::LineMargin::paintEvent(QPaintEvent *paintEvent)
 
                 const QPixmap &foldPixmap = blockFolded ? m_editor->m_foldClosed
                                                         : m_editor->m_foldOpen;
-                painter.drawPixmap(width() - foldPixmapWidth,
-                                   top + (metrics.height() - foldPixmap.height()) / 2,
+                painter.drawPixmap(QPointF(width() - foldPixmapWidth,
+                                           top + (metrics.height() - m_editor->m_foldIconSize) / 2),
                                    foldPixmap);
             }
         }
 
         block = block.next();
+        ++blockNumber;
         top = bottom;
         bottom = top + m_editor->blockBoundingRect(block).height();
     }
@@ -1522,13 +2380,14 @@ void SyntaxTextEdit::LineMargin::mouseMoveEvent(QMouseEvent *e)
 {
     const QPoint eventPos = e->pos();
     QTextCursor lineCursor = m_editor->cursorForPosition(QPoint(0, eventPos.y()));
-    const int foldPixmapWidth = m_editor->m_foldOpen.width() + 4;
+    const int foldPixmapWidth = m_editor->m_foldIconSize + 4;
 
     m_foldHoverLine = -1;
     if (m_editor->showFolding()) {
         if (!m_editor->showLineNumbers() || eventPos.x() >= width() - foldPixmapWidth) {
             QTextBlock block = lineCursor.block();
-            if (block.isValid() && m_editor->m_highlighter->isFoldable(block))
+            if (block.isValid()
+                    && m_editor->m_highlighter->isFoldable(block, SyntaxHighlighter::PublishedFolds))
                 m_foldHoverLine = block.blockNumber();
         }
         update();
@@ -1558,7 +2417,7 @@ void SyntaxTextEdit::LineMargin::mousePressEvent(QMouseEvent *e)
     m_marginSelectStart = -1;
     if (e->button() == Qt::LeftButton) {
         const QPoint eventPos = e->pos();
-        const int foldPixmapWidth = m_editor->m_foldOpen.width() + 4;
+        const int foldPixmapWidth = m_editor->m_foldIconSize + 4;
         QTextCursor lineCursor = m_editor->cursorForPosition(QPoint(0, eventPos.y()));
         if (m_editor->showLineNumbers()
                 && (!m_editor->showFolding() || eventPos.x() < width() - foldPixmapWidth)) {
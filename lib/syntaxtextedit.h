@@ -18,6 +18,14 @@
 #define QTEXTPAD_SYNTAXTEXTEDIT_H
 
 #include <QPlainTextEdit>
+#include <QTextBlock>
+#include <QJsonObject>
+
+#include <memory>
+#include <climits>
+
+#include "framestats.h"
+#include "documentsearch.h"
 
 namespace KSyntaxHighlighting
 {
@@ -27,6 +35,8 @@ namespace KSyntaxHighlighting
 }
 
 class SyntaxHighlighter;
+class DocumentMinimap;
+class QTimer;
 
 class QPrinter;
 
@@ -36,6 +46,14 @@ class SyntaxTextEdit : public QPlainTextEdit
 
 public:
     explicit SyntaxTextEdit(QWidget *parent = nullptr);
+    ~SyntaxTextEdit() Q_DECL_OVERRIDE;
+
+#ifdef QTEXTPAD_FRAME_STATS
+    // Frame timing overlay and trace, see framestats.h
+    void setShowFrameStats(bool show);
+    bool showFrameStats() const;
+    bool saveFrameTrace(const QString &filename) const;
+#endif
 
     void deleteSelection();
     void deleteLines();
@@ -45,10 +63,17 @@ public:
     bool showLineNumbers() const;
     void setShowFolding(bool show);
     bool showFolding() const;
+    void setShowMinimap(bool show);
+    bool showMinimap() const;
 
     void setShowWhitespace(bool show);
     bool showWhitespace() const;
 
+    // Skip text shaping for fixed-pitch fonts.  Qt still shapes text that
+    // needs it (e.g. complex scripts), but this disables font ligatures.
+    void setFastMonospaceLayout(bool enable);
+    bool fastMonospaceLayout() const;
+
     void setScrollPastEndOfFile(bool scroll);
     bool scrollPastEndOfFile() const;
 
@@ -71,6 +96,7 @@ public:
     IndentationMode indentationMode() const { return m_indentationMode; }
 
     int textColumn(const QString &block, int positionInBlock) const;
+    int textColumn(const QTextBlock &block, int positionInBlock) const;
     void moveCursorTo(int line, int column = 0);
 
     void moveLines(QTextCursor::MoveOperation op);
@@ -99,9 +125,21 @@ public:
     QTextCursor textSearch(const QTextCursor &start, const SearchParams& params,
                            bool matchFirst, bool reverse = false,
                            QRegularExpressionMatch *regexMatch = nullptr);
+
+    // Finds every match that lies entirely within [from, to), searching
+    // the document only once
+    QVector<DocumentSearch::Match> findAll(const SearchParams &params, int from, int to);
     void setLiveSearch(const SearchParams& params);
     void clearLiveSearch();
 
+    // The live search matches are counted in the background, so the count
+    // may be incomplete.  liveSearchMatchIndex() returns the 1-based index
+    // of the match selected by cursor, 0 if it isn't on a match, or -1 if
+    // its index isn't known yet.
+    int liveSearchMatchCount() const;
+    bool liveSearchComplete() const;
+    int liveSearchMatchIndex(const QTextCursor &cursor) const;
+
     void setMatchBraces(bool match);
     bool matchBraces() const;
 
@@ -122,6 +160,14 @@ public:
     void setSyntax(const KSyntaxHighlighting::Definition &syntax);
     QString syntaxName() const;
 
+    QVector<int> foldedBlocks() const;
+    void setFoldedBlocks(const QVector<int> &blockNumbers);
+
+    void setHighlightProfiling(bool enable);
+    bool highlightProfiling() const;
+    void resetHighlightProfile();
+    QJsonObject highlightProfile() const;
+
     QFont defaultFont() const;
 
 protected:
@@ -133,6 +179,7 @@ protected:
 Q_SIGNALS:
     void undoRequested();
     void redoRequested();
+    void liveSearchUpdated();
 
 public Q_SLOTS:
     void cutLines();
@@ -144,6 +191,8 @@ public Q_SLOTS:
     void unfoldCurrentLine();
     void foldAll();
     void unfoldAll();
+    void foldToLevel(int level);
+    void foldAllExceptCurrent();
 
     void zoomIn();      // Hides QPlainTextEdit::zoomIn(int = 1)
     void zoomOut();     // Hides QPlainTextEdit::zoomOut(int = 1)
@@ -158,10 +207,15 @@ private Q_SLOTS:
     void updateTabMetrics();
     void updateTextMetrics();
     void updateLiveSearch();
+    void updateTextSnapshot(int position, int charsRemoved, int charsAdded);
+    void updateLiveSearchMatches(int position, int charsRemoved, int charsAdded);
+    void updateWrapLayout(int position, int charsRemoved, int charsAdded);
+    void startLiveSearchScan();
     void updateExtraSelections();
 
 private:
     QWidget *m_lineMargin;
+    DocumentMinimap *m_minimap;
     SyntaxHighlighter *m_highlighter;
     QColor m_lineMarginBg, m_lineMarginFg;
     QColor m_codeFoldingBg, m_codeFoldingFg;
@@ -172,8 +226,10 @@ private:
     QColor m_braceMatchBg;
     QColor m_errorBg;
     QColor m_editorBg;
+    QColor m_minimapViewportBg;
     int m_tabCharSize, m_indentWidth;
     int m_longLineMarker;
+    qreal m_longLineOffset;
     IndentationMode m_indentationMode;
     int m_originalFontSize;
 
@@ -187,17 +243,88 @@ private:
         LongLineEdge = (1U<<5),
         ExternalUndoRedo = (1U<<6),
         ShowFolding = (1U<<7),
+        ShowMinimap = (1U<<8),
+        FastMonospaceLayout = (1U<<9),
     };
     Q_DECLARE_FLAGS(SyntaxTextEdit_Configs, SyntaxTextEdit_Config)
     SyntaxTextEdit_Configs m_config;
 
     QPixmap m_foldOpen, m_foldClosed;
+    int m_foldIconSize;
+
+    // Background layout of word-wrapped blocks.  The pass covers the block
+    // numbers from m_wrapLayoutFirst to m_wrapLayoutLast, and any range
+    // edited while it runs is measured after it.
+    QTimer *m_wrapLayoutTimer;
+    int m_wrapLayoutFirst, m_wrapLayoutLast, m_wrapLayoutNext;
+    int m_wrapPendingFirst, m_wrapPendingLast;
+    int m_wrapLayoutBlockCount;
+    bool m_wrapLayoutEstimating;
+    int m_wrapLayoutWidth;
 
     SearchParams m_liveSearch;
     QList<QTextEdit::ExtraSelection> m_braceMatch;
-    QList<QTextEdit::ExtraSelection> m_searchResults;
+
+    // Cached QTextDocument::toRawText() for searching, or null if outdated
+    QString m_textSnapshot;
+    const QString &textSnapshot();
+
+    // Sorted live search matches, painted directly for the visible blocks.
+    // Matches starting before m_searchScanEnd are complete; the rest of the
+    // document is still being scanned in the background.
+    QVector<DocumentSearch::Match> m_searchMatches;
+    quint64 m_searchGeneration;
+    int m_searchScanEnd;
+    bool m_searchComplete;
+    QTimer *m_searchScanTimer;
+    std::shared_ptr<QAtomicInt> m_searchScanCancel;
+
+    void scanLiveSearch(int from, int to);
+    void replaceLiveSearchMatches(int from, int to,
+                                  const QVector<DocumentSearch::Match> &matches);
+    void cancelLiveSearchScan();
+    void finishLiveSearchScan(quint64 generation, int from, int to,
+                              const QVector<DocumentSearch::Match> &matches,
+                              bool complete);
 
     void updateScrollBars();
+    void updateAfterFolding();
+    void updateMinimapGeometry();
+    void startWrapLayout(int firstBlock = 0, int lastBlock = INT_MAX);
+    void continueWrapLayout();
+    QFont layoutFont(QFont font) const;
+    void paintBackgroundLayers(const QRect &eventRect);
+    void paintSearchMatches(QPainter &painter, const QTextBlock &block,
+                            const QPointF &offset, int &paintLimit);
+    void paintIndentGuides(const QRect &eventRect);
+    void paintBlockIndentGuides(QPainter &painter, const QTextBlock &block,
+                                const QRectF &blockRect, const QTextCursor &cursor,
+                                int guideWidth, qreal indentLine, qreal lineOffset);
+    void updateBlockRows(const QTextBlock &block);
+
+    // The block with the current line highlight, as of the last repaint
+    QTextBlock m_cursorLineBlock;
+    int m_cursorLineNumber;
+
+#ifdef QTEXTPAD_FRAME_STATS
+    FrameStats m_frameStats;
+    FrameStatsOverlay *m_frameStatsOverlay;
+#endif
+    void updateLongLineOffset();
+
+    // Very long blocks are split into fixed-size segments, with the visual
+    // column at the start of each segment cached so that column lookups
+    // only need to scan a single segment.
+    struct LongLineSegments
+    {
+        QTextBlock block;
+        int revision;
+        QVector<int> columns;
+
+        LongLineSegments() : revision(-1) { }
+    };
+    mutable LongLineSegments m_longLineSegments;
+    const QVector<int> &longLineSegments(const QTextBlock &block) const;
 
 private:
     class LineMargin : public QWidget
@@ -221,6 +348,18 @@ private:
         SyntaxTextEdit *m_editor;
         int m_marginSelectStart;
         int m_foldHoverLine;
+
+        // Line number digits, pre-rendered in the normal and current line
+        // colors.  Rebuilt when the font, colors or pixel ratio change.
+        QPixmap m_digitGlyphs;
+        QFont m_digitFont;
+        QColor m_digitColors[2];
+        qreal m_digitAdvance[10];
+        int m_digitCellWidth, m_digitHeight;
+
+        void updateDigitGlyphs();
+        void drawLineNumber(QPainter &painter, qreal right, qreal top,
+                            int lineNum, bool cursorLine);
     };
 };
 
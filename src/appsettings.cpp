@@ -24,10 +24,15 @@
 #include <QLockFile>
 #include <QIcon>
 
+#include <climits>
+
 #define RECENT_FILES        10
 #define RECENT_SEARCHES     20
 #define FM_CACHE_SIZE       50
 
+// Upper limit on the folded blocks restored for a single file
+#define FM_MAX_FOLDS        100000
+
 #ifdef Q_OS_WIN
 #define FILE_COMPARE_CS Qt::CaseInsensitive
 #else
@@ -124,6 +129,59 @@ static QString fmDecode(const QByteArray &value)
             .replace(QLatin1String("%25"), QLatin1String("%"));
 }
 
+// Folded blocks are stored as deltas from the previous folded block, and
+// runs of equal deltas are collapsed to "delta*count".  E.g. folded blocks
+// 3, 10, 17, 24, 100 are encoded as "3,7*3,76".
+QByteArray QTextPadSettings::encodeFoldedBlocks(const QVector<int> &foldedBlocks)
+{
+    QByteArray encoded;
+    int previous = 0;
+    for (int i = 0; i < foldedBlocks.size(); ) {
+        const int delta = foldedBlocks.at(i) - previous;
+        int count = 1;
+        while (i + count < foldedBlocks.size()
+                && foldedBlocks.at(i + count) - foldedBlocks.at(i + count - 1) == delta)
+            count += 1;
+
+        if (!encoded.isEmpty())
+            encoded += ',';
+        encoded += QByteArray::number(delta);
+        if (count > 1)
+            encoded += '*' + QByteArray::number(count);
+        previous = foldedBlocks.at(i + count - 1);
+        i += count;
+    }
+    return encoded;
+}
+
+QVector<int> QTextPadSettings::decodeFoldedBlocks(const QByteArray &value)
+{
+    QVector<int> foldedBlocks;
+    int blockNumber = 0;
+    for (const QByteArray &run : value.split(',')) {
+        const int countPos = run.indexOf('*');
+        bool ok;
+        const int delta = run.left(countPos).toInt(&ok);
+        if (!ok || delta < 0 || (delta == 0 && !foldedBlocks.isEmpty()))
+            return QVector<int>();
+        const int count = (countPos >= 0) ? run.mid(countPos + 1).toInt(&ok) : 1;
+        if (!ok || count <= 0 || (delta == 0 && count > 1))
+            return QVector<int>();
+
+        // Discard entries that would overflow the block number or restore
+        // an unreasonable number of folds
+        if (count > FM_MAX_FOLDS - foldedBlocks.size()
+                || (delta > 0 && count > (INT_MAX - blockNumber) / delta))
+            return QVector<int>();
+        foldedBlocks.reserve(foldedBlocks.size() + count);
+        for (int i = 0; i < count; ++i) {
+            blockNumber += delta;
+            foldedBlocks.append(blockNumber);
+        }
+    }
+    return foldedBlocks;
+}
+
 FileModes QTextPadSettings::fileModes(const QString &filename)
 {
     const QString absFilename = QFileInfo(filename).absoluteFilePath();
@@ -143,16 +201,19 @@ FileModes QTextPadSettings::fileModes(const QString &filename)
                 if (parts.size() > 2)
                     modes.syntax = fmDecode(parts[2]);
                 modes.lineNum = (parts.size() > 3) ? parts[3].toInt() : 0;
+                if (parts.size() > 4 && !parts[4].isEmpty())
+                    modes.foldedBlocks = decodeFoldedBlocks(parts[4]);
                 return modes;
             }
         }
     }
 
-    return { QString(), QString(), 0 };
+    return { QString(), QString(), 0, QVector<int>() };
 }
 
 void QTextPadSettings::setFileModes(const QString &filename, const QString &encoding,
-                                    const QString &syntax, int lineNum)
+                                    const QString &syntax, int lineNum,
+                                    const QVector<int> &foldedBlocks)
 {
     const QString absFilename = QFileInfo(filename).absoluteFilePath();
 
@@ -163,7 +224,8 @@ void QTextPadSettings::setFileModes(const QString &filename, const QString &enco
     QFile cacheFile(fmCacheFileName());
     QList<QByteArray> lines;
     lines << (fmEncode(absFilename) + ':' + fmEncode(encoding) + ':'
-              + fmEncode(syntax) + ':' + QByteArray::number(lineNum)) + '\n';
+              + fmEncode(syntax) + ':' + QByteArray::number(lineNum) + ':'
+              + encodeFoldedBlocks(foldedBlocks)) + '\n';
     if (cacheFile.open(QIODevice::ReadOnly)) {
         while (lines.size() < FM_CACHE_SIZE) {
             const QByteArray line = cacheFile.readLine();
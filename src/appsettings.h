@@ -19,6 +19,7 @@
 
 #include <QSettings>
 #include <QSize>
+#include <QVector>
 
 #define SIMPLE_SETTING(type, name, get, set, defaultValue) \
     type get() const { return m_settings.value(QStringLiteral(name), defaultValue).value<type>(); } \
@@ -29,6 +30,7 @@ struct FileModes
     QString encoding;
     QString syntax;
     int lineNum;
+    QVector<int> foldedBlocks;
 };
 
 class QTextPadSettings
@@ -43,7 +45,13 @@ public:
 
     static FileModes fileModes(const QString &filename);
     static void setFileModes(const QString &filename, const QString &encoding,
-                             const QString &syntax, int lineNum);
+                             const QString &syntax, int lineNum,
+                             const QVector<int> &foldedBlocks);
+
+    // Compact encoding of the folded block numbers in the file modes cache.
+    // Malformed values decode to an empty list.
+    static QByteArray encodeFoldedBlocks(const QVector<int> &foldedBlocks);
+    static QVector<int> decodeFoldedBlocks(const QByteArray &value);
 
     SIMPLE_SETTING(bool, "ShowToolBar", showToolBar, setShowToolBar, true)
     SIMPLE_SETTING(bool, "ShowStatusBar", showStatusBar, setShowStatusBar, true)
@@ -59,6 +67,9 @@ public:
     SIMPLE_SETTING(bool, "Editor/LineNumbers", lineNumbers, setLineNumbers, false)
     SIMPLE_SETTING(bool, "Editor/ShowFolding", showFolding, setShowFolding, false)
     SIMPLE_SETTING(bool, "Editor/ShowWhitespace", showWhitespace, setShowWhitespace, false)
+    SIMPLE_SETTING(bool, "Editor/ShowMinimap", showMinimap, setShowMinimap, false)
+    SIMPLE_SETTING(bool, "Editor/FastMonospaceLayout", fastMonospaceLayout,
+                   setFastMonospaceLayout, false)
     SIMPLE_SETTING(bool, "Editor/HighlightCurrentLine", highlightCurLine,
                    setHighlightCurLine, true)
     SIMPLE_SETTING(bool, "Editor/MatchBraces", matchBraces, setMatchBraces, true)
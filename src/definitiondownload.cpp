@@ -96,6 +96,7 @@ void DefinitionDownloadDialog::downloadFinished()
     m_status->appendPlainText(tr("Update operation completed (%1)").arg(timeStr));
     m_buttonBox->button(QDialogButtonBox::Close)->setEnabled(true);
     m_downloader->deleteLater();
+    Q_EMIT definitionsUpdated();
 }
 
 void DefinitionDownloadDialog::closeEvent(QCloseEvent *e)
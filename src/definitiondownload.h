@@ -36,6 +36,10 @@ class DefinitionDownloadDialog : public QDialog
 public:
     DefinitionDownloadDialog(KSyntaxHighlighting::Repository *repository, QWidget *parent);
 
+Q_SIGNALS:
+    // Emitted after the repository was updated (and possibly reloaded)
+    void definitionsUpdated();
+
 public Q_SLOTS:
     void downloadFinished();
 
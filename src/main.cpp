@@ -162,8 +162,9 @@ int main(int argc, char *argv[])
     appIcon.addFile(QStringLiteral(":/icons/qtextpad-128.png"), QSize(128, 128));
     QApplication::setWindowIcon(appIcon);
 
-    QTextPadWindow win;
-    win.show();
+    auto win = new QTextPadWindow;
+    win->setAttribute(Qt::WA_DeleteOnClose);
+    win->show();
 
     QString startupFile;
     int startupLine = -1;
@@ -195,14 +196,14 @@ int main(int argc, char *argv[])
     QString textEncoding;
     if (parser.isSet(encodingOption))
         textEncoding = parser.value(encodingOption);
-    if (!startupFile.isEmpty() && win.loadDocumentFrom(startupFile, textEncoding)) {
+    if (!startupFile.isEmpty() && win->loadDocumentFrom(startupFile, textEncoding)) {
         if (startupLine > 0)
-            win.gotoLine(startupLine, startupCol);
+            win->gotoLine(startupLine, startupCol);
         if (parser.isSet(syntaxOption)) {
             auto syntaxRepo = SyntaxTextEdit::syntaxRepo();
             auto syntaxDef = syntaxRepo->definitionForName(parser.value(syntaxOption));
             if (syntaxDef.isValid()) {
-                win.setSyntax(syntaxDef);
+                win->setSyntax(syntaxDef);
             } else {
                 qDebug("%s", qPrintable(
                     QCoreApplication::translate("main", "Invalid syntax definition specified: %1")
@@ -39,8 +39,8 @@
 #include <QFileInfo>
 #include <QPrinter>
 #include <QDateTime>
-#include <QProcess>
 #include <QFileSystemWatcher>
+#include <QJsonDocument>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
@@ -140,6 +140,8 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     m_editor->setShowIndentGuides(settings.indentationGuides());
     m_editor->setShowLongLineEdge(settings.showLongLineMargin());
     m_editor->setShowWhitespace(settings.showWhitespace());
+    m_editor->setShowMinimap(settings.showMinimap());
+    m_editor->setFastMonospaceLayout(settings.fastMonospaceLayout());
     m_editor->setTabWidth(settings.tabWidth());
     m_editor->setIndentWidth(settings.indentWidth());
     m_editor->setLongLineWidth(settings.longLineWidth());
@@ -182,8 +184,12 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     quitAction->setShortcut(QKeySequence::Quit);
 
     connect(newAction, &QAction::triggered, this, &QTextPadWindow::newDocument);
-    connect(newWindowAction, &QAction::triggered, [](bool) {
-        QProcess::startDetached(QCoreApplication::applicationFilePath(), QStringList());
+    connect(newWindowAction, &QAction::triggered, this, [](bool) {
+        // New windows share the process, and therefore the syntax
+        // repository and other caches, with the existing windows.
+        auto window = new QTextPadWindow;
+        window->setAttribute(Qt::WA_DeleteOnClose);
+        window->show();
     });
     connect(openAction, &QAction::triggered, this, &QTextPadWindow::loadDocument);
     connect(m_reloadAction, &QAction::triggered, this, &QTextPadWindow::reloadDocument);
@@ -192,7 +198,7 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     connect(saveCopyAction, &QAction::triggered, this, &QTextPadWindow::saveDocumentCopy);
     connect(printAction, &QAction::triggered, this, &QTextPadWindow::printDocument);
     connect(printPreviewAction, &QAction::triggered, this, &QTextPadWindow::printPreviewDocument);
-    connect(quitAction, &QAction::triggered, this, &QWidget::close);
+    connect(quitAction, &QAction::triggered, this, [] { QApplication::closeAllWindows(); });
 
     QMenu *editMenu = menuBar()->addMenu(tr("&Edit"));
     auto undoAction = editMenu->addAction(ICON("edit-undo"), tr("&Undo"));
@@ -297,6 +303,10 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     auto showWhitespaceAction = viewMenu->addAction(tr("Show White&space"));
     showWhitespaceAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_W);
     showWhitespaceAction->setCheckable(true);
+    auto showMinimapAction = viewMenu->addAction(tr("Show Mini&map"));
+    showMinimapAction->setCheckable(true);
+    auto fastLayoutAction = viewMenu->addAction(tr("Fast Monospace &Rendering"));
+    fastLayoutAction->setCheckable(true);
     (void) viewMenu->addSeparator();
     auto scrollPastEndOfFileAction = viewMenu->addAction(tr("Scroll &Past End of File"));
     scrollPastEndOfFileAction->setCheckable(true);
@@ -349,6 +359,16 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
                 m_editor->setShowWhitespace(show);
                 QTextPadSettings().setShowWhitespace(show);
             });
+    connect(showMinimapAction, &QAction::toggled, this,
+            [this](bool show) {
+                m_editor->setShowMinimap(show);
+                QTextPadSettings().setShowMinimap(show);
+            });
+    connect(fastLayoutAction, &QAction::toggled, this,
+            [this](bool enable) {
+                m_editor->setFastMonospaceLayout(enable);
+                QTextPadSettings().setFastMonospaceLayout(enable);
+            });
     connect(scrollPastEndOfFileAction, &QAction::toggled, this,
             [this](bool scroll) {
                 m_editor->setScrollPastEndOfFile(scroll);
@@ -397,6 +417,14 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     foldAllAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_Minus);
     auto unfoldAllAction = foldMenu->addAction(tr("E&xpand All"));
     unfoldAllAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_Plus);
+    auto foldExceptAction = foldMenu->addAction(tr("Collapse All Except C&urrent"));
+    QMenu *foldLevelMenu = foldMenu->addMenu(tr("Collapse to &Level"));
+    for (int level = 1; level <= 9; ++level) {
+        auto levelAction = foldLevelMenu->addAction(tr("Level &%1").arg(level));
+        connect(levelAction, &QAction::triggered, this, [this, level] {
+            m_editor->foldToLevel(level);
+        });
+    }
 
     connect(insertDTL, &QAction::triggered, this, [this](bool) {
         insertDateTime(QLocale::LongFormat);
@@ -417,6 +445,7 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     connect(unfoldAction, &QAction::triggered, m_editor, &SyntaxTextEdit::unfoldCurrentLine);
     connect(foldAllAction, &QAction::triggered, m_editor, &SyntaxTextEdit::foldAll);
     connect(unfoldAllAction, &QAction::triggered, m_editor, &SyntaxTextEdit::unfoldAll);
+    connect(foldExceptAction, &QAction::triggered, m_editor, &SyntaxTextEdit::foldAllExceptCurrent);
 
     QMenu *settingsMenu = menuBar()->addMenu(tr("&Settings"));
     auto fontAction = settingsMenu->addAction(tr("Editor &Font..."));
@@ -464,6 +493,20 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     connect(m_autoIndentAction, &QAction::toggled, this, &QTextPadWindow::setAutoIndent);
     connect(showFilePathAction, &QAction::toggled, this, &QTextPadWindow::toggleFilePath);
 
+    // Debugging tools are only shown when profiling was requested at startup
+    if (m_editor->highlightProfiling()) {
+        QMenu *debugMenu = menuBar()->addMenu(tr("&Debug"));
+        auto profileAction = debugMenu->addAction(tr("&Profile Syntax Highlighting"));
+        profileAction->setCheckable(true);
+        profileAction->setChecked(true);
+        auto resetProfileAction = debugMenu->addAction(tr("&Reset Highlighter Profile"));
+        auto saveProfileAction = debugMenu->addAction(tr("&Save Highlighter Profile..."));
+
+        connect(profileAction, &QAction::toggled, m_editor, &SyntaxTextEdit::setHighlightProfiling);
+        connect(resetProfileAction, &QAction::triggered, m_editor, &SyntaxTextEdit::resetHighlightProfile);
+        connect(saveProfileAction, &QAction::triggered, this, &QTextPadWindow::saveHighlightProfile);
+    }
+
     QMenu *helpMenu = menuBar()->addMenu(tr("&Help"));
     auto aboutAction = helpMenu->addAction(ICON("help-about"), tr("&About..."));
     aboutAction->setShortcut(QKeySequence::HelpContents);
@@ -533,6 +576,8 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     showLineNumbersAction->setChecked(m_editor->showLineNumbers());
     showFoldingAction->setChecked(m_editor->showFolding());
     showWhitespaceAction->setChecked(m_editor->showWhitespace());
+    showMinimapAction->setChecked(m_editor->showMinimap());
+    fastLayoutAction->setChecked(m_editor->fastMonospaceLayout());
     scrollPastEndOfFileAction->setChecked(m_editor->scrollPastEndOfFile());
     showCurrentLineAction->setChecked(m_editor->highlightCurrentLine());
     showMatchingBraces->setChecked(m_editor->matchBraces());
@@ -615,6 +660,22 @@ void QTextPadWindow::showAbout()
     about.exec();
 }
 
+void QTextPadWindow::saveHighlightProfile()
+{
+    QString path = QFileDialog::getSaveFileName(this, tr("Save Highlighter Profile"),
+                                                QString(), tr("JSON Files (*.json)"));
+    if (path.isEmpty())
+        return;
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        QMessageBox::critical(this, QString(),
+                              tr("Cannot open file %1 for writing").arg(path));
+        return;
+    }
+    file.write(QJsonDocument(m_editor->highlightProfile()).toJson());
+}
+
 void QTextPadWindow::toggleFullScreen(bool fullScreen)
 {
     if (fullScreen) {
@@ -659,6 +720,29 @@ void QTextPadWindow::setSyntax(const KSyntaxHighlighting::Definition &syntax)
     }
 }
 
+void QTextPadWindow::refreshSyntaxDefinitions()
+{
+    // Reloading the repository invalidates the existing Definition objects,
+    // so rebuild everything that refers to them and look up the current
+    // syntax again by name.
+    const QString syntaxName = m_editor->syntaxName();
+
+    delete m_syntaxActions;
+    m_syntaxMenu->clear();
+    qDeleteAll(m_syntaxMenu->findChildren<QMenu *>(QString(), Qt::FindDirectChildrenOnly));
+    populateSyntaxMenu();
+
+    const auto popupActions = m_syntaxButton->actions();
+    for (QAction *action : popupActions) {
+        m_syntaxButton->removeAction(action);
+        delete action;
+    }
+    m_syntaxButton->addAction(new SyntaxPopupAction(this));
+
+    const auto syntax = SyntaxTextEdit::syntaxRepo()->definitionForName(syntaxName);
+    setSyntax(syntax.isValid() ? syntax : SyntaxTextEdit::nullSyntax());
+}
+
 void QTextPadWindow::setEditorTheme(const KSyntaxHighlighting::Theme &theme)
 {
     m_editor->setTheme(theme);
@@ -823,7 +907,7 @@ bool QTextPadWindow::saveDocumentTo(const QString &filename)
 
     const QTextCursor cursor = m_editor->textCursor();
     QTextPadSettings::setFileModes(filename, m_textEncoding, m_editor->syntaxName(),
-                                   cursor.blockNumber() + 1);
+                                   cursor.blockNumber() + 1, m_editor->foldedBlocks());
     QTextPadSettings().addRecentFile(filename);
     populateRecentFiles();
 
@@ -907,11 +991,16 @@ bool QTextPadWindow::loadDocumentFrom(const QString &filename, const QString &te
     if (definition.isValid())
         setSyntax(definition);
 
+    // Restore folds before moving the cursor, so the cursor's line gets
+    // unfolded if necessary.
+    if (!fileModes.foldedBlocks.isEmpty())
+        m_editor->setFoldedBlocks(fileModes.foldedBlocks);
     if (fileModes.lineNum > 0)
         gotoLine(fileModes.lineNum);
 
     setOpenFilename(filename);
-    QTextPadSettings::setFileModes(filename, m_textEncoding, definition.name(), fileModes.lineNum);
+    QTextPadSettings::setFileModes(filename, m_textEncoding, definition.name(),
+                                   fileModes.lineNum, m_editor->foldedBlocks());
     QTextPadSettings().addRecentFile(filename);
     populateRecentFiles();
 
@@ -986,7 +1075,8 @@ bool QTextPadWindow::promptForSave()
     if (documentExists()) {
         const QTextCursor cursor = m_editor->textCursor();
         QTextPadSettings::setFileModes(m_openFilename, m_textEncoding,
-                                       m_editor->syntaxName(), cursor.blockNumber() + 1);
+                                       m_editor->syntaxName(), cursor.blockNumber() + 1,
+                                       m_editor->foldedBlocks());
     }
 
     if (isDocumentModified()) {
@@ -1006,7 +1096,8 @@ bool QTextPadWindow::promptForDiscard()
     if (documentExists()) {
         const QTextCursor cursor = m_editor->textCursor();
         QTextPadSettings::setFileModes(m_openFilename, m_textEncoding,
-                                       m_editor->syntaxName(), cursor.blockNumber() + 1);
+                                       m_editor->syntaxName(), cursor.blockNumber() + 1,
+                                       m_editor->foldedBlocks());
     }
 
     if (isDocumentModified()) {
@@ -1179,7 +1270,7 @@ void QTextPadWindow::editorContextMenu(const QPoint &pos)
 void QTextPadWindow::updateCursorPosition()
 {
     const QTextCursor cursor = m_editor->textCursor();
-    const int column = m_editor->textColumn(cursor.block().text(), cursor.positionInBlock());
+    const int column = m_editor->textColumn(cursor.block(), cursor.positionInBlock());
     const int selectedChars = std::abs(cursor.selectionEnd() - cursor.selectionStart());
     QString positionText = tr("Line %1, Col %2")
                                 .arg(cursor.blockNumber() + 1)
@@ -1645,6 +1736,15 @@ void QTextPadWindow::populateSyntaxMenu()
     connect(updateAction, &QAction::triggered, this, [this] {
         auto downloadDialog = new DefinitionDownloadDialog(SyntaxTextEdit::syntaxRepo(), this);
         downloadDialog->setAttribute(Qt::WA_DeleteOnClose);
+        connect(downloadDialog, &DefinitionDownloadDialog::definitionsUpdated,
+                downloadDialog, [] {
+            // The repository is shared by every window in the process
+            const auto windows = QApplication::topLevelWidgets();
+            for (QWidget *widget : windows) {
+                if (auto window = qobject_cast<QTextPadWindow *>(widget))
+                    window->refreshSyntaxDefinitions();
+            }
+        });
         downloadDialog->show();
         downloadDialog->raise();
         downloadDialog->activateWindow();
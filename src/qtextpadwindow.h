@@ -50,6 +50,7 @@ public:
     SyntaxTextEdit *editor() { return m_editor; }
 
     void setSyntax(const KSyntaxHighlighting::Definition &syntax);
+    void refreshSyntaxDefinitions();
     void setEditorTheme(const KSyntaxHighlighting::Theme &theme);
     void setDefaultEditorTheme();
     void setEncoding(const QString &codecName);
@@ -105,6 +106,7 @@ public Q_SLOTS:
     void joinLines();
 
     void showAbout();
+    void saveHighlightProfile();
     void toggleFullScreen(bool fullScreen);
     void showSearchBar(bool show);
 
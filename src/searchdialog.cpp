@@ -30,6 +30,7 @@
 #include <QMessageBox>
 #include <QPainter>
 #include <QStringView>
+#include <climits>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
@@ -80,6 +81,9 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     m_searchText->setClearButtonEnabled(true);
     setFocusProxy(m_searchText);
 
+    m_matchCount = new QLabel(this);
+    m_matchCount->setEnabled(false);
+
     auto tbNext = new QToolButton(this);
     tbNext->setAutoRaise(true);
     tbNext->setIcon(QTextPadSettings::staticIcon(QStringLiteral("go-down"), darkTheme));
@@ -95,6 +99,7 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     layout->setSpacing(5);
     layout->addWidget(tbMenu);
     layout->addWidget(m_searchText);
+    layout->addWidget(m_matchCount);
     layout->addWidget(tbNext);
     layout->addWidget(tbPrev);
     setLayout(layout);
@@ -106,6 +111,8 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
         m_editor->setLiveSearch(m_searchParams);
     });
     connect(m_searchText, &QLineEdit::returnPressed, this, [this] { searchNext(false); });
+    connect(m_editor, &SyntaxTextEdit::liveSearchUpdated, this, &SearchWidget::updateMatchCount);
+    connect(m_editor, &QPlainTextEdit::cursorPositionChanged, this, &SearchWidget::updateMatchCount);
     connect(tbNext, &QToolButton::clicked, this, [this] { searchNext(false); });
     connect(tbPrev, &QToolButton::clicked, this, [this] { searchNext(true); });
 
@@ -209,6 +216,30 @@ void SearchWidget::updateSettings()
     m_editor->setLiveSearch(m_searchParams);
 }
 
+void SearchWidget::updateMatchCount()
+{
+    if (!isVisible() || m_searchParams.searchText.isEmpty()) {
+        m_matchCount->clear();
+        return;
+    }
+
+    // The total is still being counted in the background until the editor
+    // says it's complete, and the current match's index may not be known
+    const int total = m_editor->liveSearchMatchCount();
+    const bool complete = m_editor->liveSearchComplete();
+    const QString totalText = complete ? QString::number(total)
+                                       : tr("%1+").arg(total);
+    const int current = m_editor->liveSearchMatchIndex(m_editor->textCursor());
+    if (current > 0)
+        m_matchCount->setText(tr("%1 of %2").arg(current).arg(totalText));
+    else if (current < 0)
+        m_matchCount->setText(tr("? of %1").arg(totalText));
+    else if (complete)
+        m_matchCount->setText(tr("%n match(es)", Q_NULLPTR, total));
+    else
+        m_matchCount->setText(tr("%1 matches").arg(totalText));
+}
+
 /* Just sets some more sane defaults for QComboBox:
  * - Don't auto-insert items (we handle that manually)
  * - Disable the completer, since it insists on changing the typed
@@ -322,7 +353,15 @@ SearchDialog::~SearchDialog()
 
 SearchDialog *SearchDialog::create(QTextPadWindow *parent)
 {
-    if (s_instance) {
+    if (s_instance && parent && s_instance->parentWidget() != parent) {
+        // Move the dialog over to the window that requested it, so it
+        // operates on the correct editor and closes along with it.
+        s_instance->setParent(parent, s_instance->windowFlags());
+        s_instance->setEditor(parent->editor());
+        s_instance->show();
+        s_instance->raise();
+        s_instance->activateWindow();
+    } else if (s_instance) {
         s_instance->raise();
     } else {
         Q_ASSERT(parent);
@@ -330,12 +369,7 @@ SearchDialog *SearchDialog::create(QTextPadWindow *parent)
         s_instance->show();
         s_instance->raise();
         s_instance->activateWindow();
-
-        s_instance->m_editor = parent->editor();
-        connect(s_instance->m_editor, &SyntaxTextEdit::selectionChanged, s_instance, [] {
-            bool hasSelection = s_instance->m_editor->textCursor().hasSelection();
-            s_instance->m_replaceSelectionButton->setEnabled(hasSelection);
-        });
+        s_instance->setEditor(parent->editor());
     }
 
     if (parent)
@@ -351,6 +385,19 @@ SearchDialog *SearchDialog::create(QTextPadWindow *parent)
     return s_instance;
 }
 
+void SearchDialog::setEditor(SyntaxTextEdit *editor)
+{
+    if (m_editorConnection)
+        disconnect(m_editorConnection);
+    m_replaceCursor = QTextCursor();
+
+    m_editor = editor;
+    m_editorConnection = connect(m_editor, &SyntaxTextEdit::selectionChanged, this, [this] {
+        bool hasSelection = m_editor->textCursor().hasSelection();
+        m_replaceSelectionButton->setEnabled(hasSelection);
+    });
+}
+
 static QString translateCharEscape(QStringView digits, int *advance)
 {
     Q_ASSERT(digits.size() > 0);
@@ -615,6 +662,11 @@ void SearchDialog::performReplaceAll(ReplaceAllMode mode)
     if (searchText.isEmpty())
         return;
 
+    if (!m_regex->isChecked()) {
+        performLiteralReplaceAll(mode);
+        return;
+    }
+
     auto searchCursor = m_editor->textCursor();
     if (mode == InSelection)
         searchCursor.setPosition(m_editor->textCursor().selectionStart());
@@ -654,3 +706,37 @@ void SearchDialog::performReplaceAll(ReplaceAllMode mode)
 
     QMessageBox::information(this, QString(), tr("Successfully replaced %1 matches").arg(replacements));
 }
+
+void SearchDialog::performLiteralReplaceAll(ReplaceAllMode mode)
+{
+    // Without regex captures, all of the matches can be found in a single
+    // pass over the document before anything is replaced
+    const QTextCursor selection = m_editor->textCursor();
+    const int from = (mode == InSelection) ? selection.selectionStart() : 0;
+    const int to = (mode == InSelection) ? selection.selectionEnd() : INT_MAX;
+    const auto matches = m_editor->findAll(m_searchParams, from, to);
+    if (matches.isEmpty()) {
+        if (mode == InSelection)
+            QMessageBox::information(this, QString(), tr("The specified text was not found in the selection"));
+        else
+            QMessageBox::information(this, QString(), tr("The specified text was not found"));
+        return;
+    }
+
+    QString replaceText = m_replaceText->currentText();
+    if (m_escapes->isChecked())
+        replaceText = translateEscapes(replaceText);
+
+    // Replace from the end, so the positions of the remaining matches
+    // aren't affected
+    QTextCursor replaceCursor = selection;
+    replaceCursor.beginEditBlock();
+    for (auto iter = matches.crbegin(); iter != matches.crend(); ++iter) {
+        replaceCursor.setPosition(iter->start);
+        replaceCursor.setPosition(iter->start + iter->length, QTextCursor::KeepAnchor);
+        replaceCursor.insertText(replaceText);
+    }
+    replaceCursor.endEditBlock();
+
+    QMessageBox::information(this, QString(), tr("Successfully replaced %1 matches").arg(matches.size()));
+}
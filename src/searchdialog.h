@@ -25,6 +25,7 @@
 #include "syntaxtextedit.h"
 
 class QLineEdit;
+class QLabel;
 class QComboBox;
 class QCheckBox;
 class QPushButton;
@@ -57,9 +58,11 @@ protected:
 
 private Q_SLOTS:
     void updateSettings();
+    void updateMatchCount();
 
 private:
     QLineEdit *m_searchText;
+    QLabel *m_matchCount;
     QAction *m_caseSensitive;
     QAction *m_wholeWord;
     QAction *m_regex;
@@ -94,10 +97,12 @@ private Q_SLOTS:
 private:
     explicit SearchDialog(QWidget *parent);
 
+    void setEditor(SyntaxTextEdit *editor);
     void syncSearchSettings(bool saveRecent);
 
     enum ReplaceAllMode { WholeDocument, InSelection };
     void performReplaceAll(ReplaceAllMode mode);
+    void performLiteralReplaceAll(ReplaceAllMode mode);
 
     QComboBox *m_searchText;
     QComboBox *m_replaceText;
@@ -110,6 +115,7 @@ private:
     QTextCursor m_replaceCursor;
 
     SyntaxTextEdit *m_editor;
+    QMetaObject::Connection m_editorConnection;
     SyntaxTextEdit::SearchParams m_searchParams;
     QRegularExpressionMatch m_regexMatch;
 };
@@ -0,0 +1,61 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTest>
+
+#include "appsettings.h"
+
+class TestFoldedBlocks : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void roundTrip();
+    void malformed_data();
+    void malformed();
+};
+
+void TestFoldedBlocks::roundTrip()
+{
+    const QVector<int> folded{0, 3, 10, 17, 24, 100};
+    const QByteArray encoded = QTextPadSettings::encodeFoldedBlocks(folded);
+    QCOMPARE(encoded, QByteArray("0,3,7*3,76"));
+    QCOMPARE(QTextPadSettings::decodeFoldedBlocks(encoded), folded);
+}
+
+void TestFoldedBlocks::malformed_data()
+{
+    QTest::addColumn<QByteArray>("value");
+
+    QTest::newRow("not a number") << QByteArray("3,x");
+    QTest::newRow("negative delta") << QByteArray("3,-1");
+    QTest::newRow("repeated block") << QByteArray("3,0");
+    QTest::newRow("repeated zero delta") << QByteArray("0*5");
+    QTest::newRow("zero count") << QByteArray("3*0");
+    QTest::newRow("negative count") << QByteArray("3*-2");
+    QTest::newRow("block overflow") << QByteArray("1000000*3000");
+    QTest::newRow("delta overflow") << QByteArray("2147483647,1");
+    QTest::newRow("too many folds") << QByteArray("1*2000000000");
+}
+
+void TestFoldedBlocks::malformed()
+{
+    QFETCH(QByteArray, value);
+    QVERIFY(QTextPadSettings::decodeFoldedBlocks(value).isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestFoldedBlocks)
+#include "appsettings_test.moc"
@@ -0,0 +1,127 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTest>
+
+#include "blockmetadata.h"
+
+#define REGION_A    1
+#define REGION_B    2
+
+class TestBlockMetadata : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void nestedRegions();
+    void beginAfterEnd();
+    void closedOutOfOrder();
+    void incrementalUpdate();
+};
+
+static FoldMarker beginRegion(quint16 regionId) { return {regionId, true}; }
+static FoldMarker endRegion(quint16 regionId) { return {regionId, false}; }
+
+static void setMarkers(BlockMetadata &metadata, const QVector<QVector<FoldMarker>> &blocks)
+{
+    metadata.reset(blocks.size());
+    for (int i = 0; i < blocks.size(); ++i)
+        metadata.setFoldMarkers(i, blocks.at(i));
+    metadata.updateRegions();
+}
+
+void TestBlockMetadata::nestedRegions()
+{
+    BlockMetadata metadata;
+    setMarkers(metadata, {
+        {beginRegion(REGION_A)},
+        {beginRegion(REGION_A)},
+        {endRegion(REGION_A)},
+        {endRegion(REGION_A)},
+        {beginRegion(REGION_A)},
+    });
+
+    QCOMPARE(metadata.regionFoldEnd(0), 3);
+    QCOMPARE(metadata.regionFoldEnd(1), 2);
+    QCOMPARE(metadata.regionFoldEnd(2), int(BlockMetadata::NoFold));
+    QCOMPARE(metadata.regionFoldEnd(3), int(BlockMetadata::NoFold));
+    QCOMPARE(metadata.regionFoldEnd(4), int(BlockMetadata::UnterminatedFold));
+}
+
+void TestBlockMetadata::beginAfterEnd()
+{
+    // A block that opens a region after closing another one still starts
+    // a fold, as with KSyntaxHighlighting's startsFoldingRegion().
+    BlockMetadata metadata;
+    setMarkers(metadata, {
+        {beginRegion(REGION_A)},
+        {beginRegion(REGION_B), endRegion(REGION_A)},
+        {},
+        {endRegion(REGION_B)},
+    });
+
+    QCOMPARE(metadata.regionFoldEnd(0), 1);
+    QCOMPARE(metadata.regionFoldEnd(1), 3);
+    QCOMPARE(metadata.regionFoldEnd(2), int(BlockMetadata::NoFold));
+}
+
+void TestBlockMetadata::closedOutOfOrder()
+{
+    BlockMetadata metadata;
+    setMarkers(metadata, {
+        {beginRegion(REGION_A)},
+        {beginRegion(REGION_B)},
+        {endRegion(REGION_A)},
+        {endRegion(REGION_B)},
+    });
+
+    QCOMPARE(metadata.regionFoldEnd(0), 2);
+    QCOMPARE(metadata.regionFoldEnd(1), 3);
+}
+
+void TestBlockMetadata::incrementalUpdate()
+{
+    BlockMetadata metadata;
+    setMarkers(metadata, {
+        {beginRegion(REGION_A)},
+        {},
+        {beginRegion(REGION_A)},
+        {endRegion(REGION_A)},
+        {endRegion(REGION_A)},
+        {beginRegion(REGION_B)},
+        {endRegion(REGION_B)},
+    });
+    QCOMPARE(metadata.regionFoldEnd(0), 4);
+    QCOMPARE(metadata.regionFoldEnd(2), 3);
+    QCOMPARE(metadata.regionFoldEnd(5), 6);
+
+    metadata.setFoldMarkers(1, {beginRegion(REGION_A)});
+    metadata.updateRegions();
+    QCOMPARE(metadata.regionFoldEnd(0), int(BlockMetadata::UnterminatedFold));
+    QCOMPARE(metadata.regionFoldEnd(1), 4);
+    QCOMPARE(metadata.regionFoldEnd(2), 3);
+    QCOMPARE(metadata.regionFoldEnd(5), 6);
+
+    metadata.setFoldMarkers(1, {});
+    metadata.updateRegions();
+    QCOMPARE(metadata.regionFoldEnd(0), 4);
+    QCOMPARE(metadata.regionFoldEnd(1), int(BlockMetadata::NoFold));
+    QCOMPARE(metadata.regionFoldEnd(2), 3);
+    QCOMPARE(metadata.regionFoldEnd(5), 6);
+}
+
+QTEST_GUILESS_MAIN(TestBlockMetadata)
+#include "blockmetadata_test.moc"